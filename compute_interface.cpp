@@ -1,11 +1,263 @@
 #include <stdexcept>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 #include "compute_interface.hpp"
 
 extern "C" {
 #include "computesi.h"
 };
 
+struct EventState
+{
+	std::shared_ptr<compute_context> context; ///events may outlive the ComputeInterface, the context stays until the last is gone
+	compute_fence fences[COMPUTE_RING_COUNT]; ///newest submission of the operation on each ring, seq 0 for none
+	bool readbackPending;
+	compute_readback readback;
+	
+	EventState(const std::shared_ptr<compute_context>& ctx) : context(ctx), readbackPending(false)
+	{
+		for (int i = 0; i < COMPUTE_RING_COUNT; i++)
+		{
+			fences[i].ring = i;
+			fences[i].seq = 0;
+		}
+	}
+	
+	///a readback nobody waited for only releases its bounce memory, the host buffer may be freed already
+	~EventState()
+	{
+		if (readbackPending)
+		{
+			compute_readback_cancel(&readback);
+		}
+	}
+};
+
+///Makes every submission of one operation depend on an EventDependence and collects them into the operation's event.
+///Nothing blocks here: the C layer turns unfinished dependencies into GPU side waits.
+class SubmissionScope
+{
+	std::shared_ptr<compute_context> sharedContext;
+	compute_context* context;
+	uint32_t first[COMPUTE_RING_COUNT];
+public:
+	SubmissionScope(const std::shared_ptr<compute_context>& ctx, const EventDependence& evd) : sharedContext(ctx), context(ctx.get())
+	{
+		std::vector<compute_fence> deps;
+		
+		for (size_t i = 0; i < evd.events.size(); i++)
+		{
+			const EventState* state = evd.events[i].state.get();
+			
+			for (int r = 0; state && r < COMPUTE_RING_COUNT; r++)
+			{
+				if (state->fences[r].seq)
+				{
+					deps.push_back(state->fences[r]);
+				}
+			}
+		}
+		
+		compute_set_dependencies(context, deps.empty() ? NULL : &deps[0], deps.size());
+		
+		for (int r = 0; r < COMPUTE_RING_COUNT; r++)
+		{
+			first[r] = context->rings[r].last_seq;
+		}
+	}
+	
+	~SubmissionScope()
+	{
+		compute_set_dependencies(context, NULL, 0);
+	}
+	
+	///rings retire in order, so the last submission on each ring completes the operation there
+	Event event() const
+	{
+		Event event;
+		event.state = std::make_shared<EventState>(sharedContext);
+		
+		for (int r = 0; r < COMPUTE_RING_COUNT; r++)
+		{
+			if (context->rings[r].last_seq != first[r])
+			{
+				event.state->fences[r].seq = context->rings[r].last_seq;
+			}
+		}
+		
+		return event;
+	}
+};
+
+Event::Event()
+{
+}
+
+bool Event::ready() const
+{
+	if (!state)
+	{
+		return true;
+	}
+	
+	if (state->readbackPending)
+	{
+		if (!compute_readback_done(&state->readback))
+		{
+			return false;
+		}
+		
+		wait();
+		return true;
+	}
+	
+	for (int i = 0; i < COMPUTE_RING_COUNT; i++)
+	{
+		if (!compute_fence_signaled(state->context.get(), &state->fences[i]))
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void Event::wait() const
+{
+	if (!state)
+	{
+		return;
+	}
+	
+	if (state->readbackPending)
+	{
+		state->readbackPending = false;
+		
+		if (compute_readback_end(&state->readback))
+		{
+			throw std::runtime_error("Event: readback failed");
+		}
+	}
+	
+	for (int i = 0; i < COMPUTE_RING_COUNT; i++)
+	{
+		if (compute_fence_wait(state->context.get(), &state->fences[i]))
+		{
+			throw std::runtime_error("Event: waiting for the GPU failed");
+		}
+	}
+}
+
+BufferView::BufferView(gpu_buffer* buf, size_t offset, size_t size, unsigned stride, int numFormat, int dataFormat) :
+	view(new gpu_buffer_view)
+{
+	if (compute_buffer_view_init(view.get(), buf, offset, size, stride, numFormat, dataFormat))
+	{
+		throw std::out_of_range("BufferView: invalid view of buffer");
+	}
+}
+
+gpu_buffer* BufferView::buffer() const
+{
+	return view->bo;
+}
+
+size_t BufferView::offset() const
+{
+	return view->offset;
+}
+
+size_t BufferView::size() const
+{
+	return view->size;
+}
+
+const uint32_t* BufferView::descriptor() const
+{
+	return compute_buffer_view_descriptor(view.get());
+}
+
+MappedRange::MappedRange(gpu_buffer* buf, size_t offset, size_t size) :
+	buf(buf), off(offset), len(size)
+{
+	if (len == 0 && off < buf->size)
+	{
+		len = buf->size - off;
+	}
+	
+	ptr = (char*)compute_map_gpu_range(buf, off, len);
+	
+	if (!ptr)
+	{
+		throw std::runtime_error("MappedRange: could not map buffer range");
+	}
+}
+
+MappedRange::MappedRange(MappedRange&& other) :
+	buf(other.buf), ptr(other.ptr), off(other.off), len(other.len)
+{
+	other.buf = NULL;
+	other.ptr = NULL;
+	other.len = 0;
+}
+
+MappedRange& MappedRange::operator=(MappedRange&& other)
+{
+	if (this != &other)
+	{
+		if (buf)
+		{
+			compute_unmap_gpu_buffer(buf);
+		}
+		
+		buf = other.buf;
+		ptr = other.ptr;
+		off = other.off;
+		len = other.len;
+		
+		other.buf = NULL;
+		other.ptr = NULL;
+		other.len = 0;
+	}
+	
+	return *this;
+}
+
+MappedRange::~MappedRange()
+{
+	if (buf)
+	{
+		compute_unmap_gpu_buffer(buf);
+	}
+}
+
+void MappedRange::invalidate()
+{
+	if (buf && compute_invalidate_mapped_range(buf, off, len))
+	{
+		throw std::runtime_error("MappedRange: waiting for the GPU failed");
+	}
+}
+
+void MappedRange::flush()
+{
+	if (buf)
+	{
+		compute_flush_mapped_range(buf, off, len);
+	}
+}
+
+uint64_t Kernel::address() const
+{
+	if (!kernel)
+	{
+		throw std::invalid_argument("Kernel::address: kernel was not loaded or is already freed");
+	}
+	
+	return kernel->va;
+}
+
 ComputeInterface::ComputeInterface(std::string driName)
 {
 	context = compute_create_context(driName.c_str());
@@ -14,16 +266,110 @@ ComputeInterface::ComputeInterface(std::string driName)
 	{
 		throw std::runtime_error("Could not open DRI interface: " + driName);
 	}
+	
+	sharedContext.reset(context, compute_free_context);
 }
 
+///the context is freed with the last Event of it
 ComputeInterface::~ComputeInterface()
 {
-	compute_free_context(context);
 }
 
-gpu_buffer* ComputeInterface::bufferAlloc(size_t size)
+void ComputeInterface::setMemoryBudget(size_t vramBytes, size_t gttBytes)
+{
+	compute_set_memory_budget(context, RADEON_DOMAIN_VRAM, vramBytes);
+	compute_set_memory_budget(context, RADEON_DOMAIN_GTT, gttBytes);
+}
+
+int ComputeInterface::compactVA()
+{
+	int moved = compute_compact_va(context);
+	
+	if (moved < 0)
+	{
+		throw std::runtime_error("VA compaction failed");
+	}
+	
+	return moved;
+}
+
+void ComputeInterface::vaStats(compute_va_stats* stats) const
+{
+	compute_get_va_stats(context, stats);
+}
+
+void ComputeInterface::enableAllocTrace(bool verbose)
+{
+	if (compute_enable_alloc_trace(context, verbose))
+	{
+		throw std::runtime_error("Could not enable allocation tracing");
+	}
+}
+
+void ComputeInterface::printAllocReport() const
+{
+	compute_print_alloc_report(context, stderr);
+}
+
+void ComputeInterface::setTransferChunking(size_t chunkSize, int slots)
+{
+	if (compute_set_staging(context, chunkSize, slots))
+	{
+		throw std::runtime_error("Invalid transfer chunking");
+	}
+}
+
+void ComputeInterface::setCopyThreads(int threads)
+{
+	compute_set_copy_threads(context, threads);
+}
+
+gpu_buffer* ComputeInterface::bufferAlloc(size_t size, bool cpuAccess)
 {
-	return compute_alloc_gpu_buffer(context, size, RADEON_DOMAIN_VRAM, 8*1024);
+	gpu_buffer* buf = compute_alloc_gpu_buffer(context, size, RADEON_DOMAIN_VRAM, 8*1024, cpuAccess ? COMPUTE_BUFFER_CPU_ACCESS : 0);
+	
+	if (!buf)
+	{
+		throw std::runtime_error("Could not allocate GPU buffer");
+	}
+	
+	return buf;
+}
+
+gpu_buffer* ComputeInterface::bufferImportHost(void* ptr, size_t size, bool readOnly)
+{
+	gpu_buffer* buf = compute_import_host_buffer(context, ptr, size, readOnly);
+	
+	if (!buf)
+	{
+		throw std::runtime_error("Could not import host memory");
+	}
+	
+	return buf;
+}
+
+int ComputeInterface::bufferExport(gpu_buffer* buf)
+{
+	int fd;
+	
+	if (compute_export_gpu_buffer(buf, &fd))
+	{
+		throw std::runtime_error("Could not export buffer: " + std::string(strerror(errno)));
+	}
+	
+	return fd;
+}
+
+gpu_buffer* ComputeInterface::bufferImport(int fd)
+{
+	gpu_buffer* buf = compute_import_gpu_buffer(context, fd);
+	
+	if (!buf)
+	{
+		throw std::runtime_error("Could not import dma-buf");
+	}
+	
+	return buf;
 }
 
 void ComputeInterface::bufferFree(gpu_buffer* buf)
@@ -31,18 +377,283 @@ void ComputeInterface::bufferFree(gpu_buffer* buf)
 	compute_free_gpu_buffer(buf);
 }
 
-void ComputeInterface::transferToGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd)
+void* ComputeInterface::bufferMap(gpu_buffer* buf)
+{
+	void* ptr = compute_map_gpu_buffer(buf);
+	
+	if (!ptr)
+	{
+		throw std::runtime_error("Could not map buffer");
+	}
+	
+	return ptr;
+}
+
+void ComputeInterface::bufferUnmap(gpu_buffer* buf)
+{
+	compute_unmap_gpu_buffer(buf);
+}
+
+uint64_t ComputeInterface::uploadTransient(const void* data, size_t size, size_t alignment)
+{
+	uint64_t va = compute_upload_transient(context, data, size, alignment);
+	
+	if (!va)
+	{
+		throw std::runtime_error("Could not upload transient data");
+	}
+	
+	return va;
+}
+
+Kernel ComputeInterface::kernelLoad(const void* code, size_t size, const compute_kernel_info& info)
+{
+	Kernel kernel;
+	compute_kernel* k = compute_create_kernel(context, code, size, &info);
+	
+	if (!k)
+	{
+		throw std::runtime_error("Could not load kernel");
+	}
+	
+	kernel.kernel = k;
+	
+	return kernel;
+}
+
+void ComputeInterface::kernelFree(Kernel& kernel)
+{
+	if (kernel.kernel)
+	{
+		compute_free_kernel(kernel.kernel);
+		kernel.kernel = NULL;
+	}
+}
+
+void ComputeInterface::completeReadbacks(const EventDependence& evd)
+{
+	for (size_t i = 0; i < evd.events.size(); i++)
+	{
+		const Event& e = evd.events[i];
+		
+		if (e.state && e.state->readbackPending)
+		{
+			e.wait();
+		}
+	}
+}
+
+void ComputeInterface::waitEvents(const EventDependence& evd)
+{
+	for (size_t i = 0; i < evd.events.size(); i++)
+	{
+		evd.events[i].wait();
+	}
+}
+
+Event ComputeInterface::transferToGPU(gpu_buffer* buf, size_t offset, const void* data, size_t size, EventDependence evd)
+{
+	waitEvents(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_copy_to_gpu(buf, offset, data, size);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferToGPU: range exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferToGPU: could not map buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::transferFromGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd)
+{
+	waitEvents(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_copy_from_gpu(buf, offset, data, size);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferFromGPU: range exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferFromGPU: could not map buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::transferToGPUAsync(gpu_buffer* buf, size_t offset, const void* data, size_t size, EventDependence evd)
+{
+	if (!compute_upload_staged(buf, size))
+	{
+		return transferToGPU(buf, offset, data, size, evd);
+	}
+	
+	completeReadbacks(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_upload_async(buf, offset, data, size, NULL);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferToGPUAsync: range exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferToGPUAsync: could not queue upload");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::transferFromGPUAsync(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd)
+{
+	completeReadbacks(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	compute_readback readback;
+	
+	int ret = compute_readback_begin(buf, offset, data, size, &readback);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferFromGPUAsync: range exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferFromGPUAsync: could not queue readback");
+	}
+	
+	Event event = scope.event();
+	event.state->readback = readback;
+	event.state->readbackPending = true;
+	
+	return event;
+}
+
+Event ComputeInterface::transferScatterToGPU(gpu_buffer* buf, const std::vector<compute_scatter_entry>& entries, EventDependence evd)
+{
+	completeReadbacks(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_scatter_to_gpu(buf, entries.data(), entries.size(), NULL);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferScatterToGPU: region exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferScatterToGPU: could not submit scatter");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::bufferFill(gpu_buffer* buf, size_t offset, size_t size, uint32_t pattern, EventDependence evd)
+{
+	SubmissionScope scope(sharedContext, evd);
+	
+	if (compute_fill_gpu(buf, offset, size, pattern, NULL))
+	{
+		throw std::runtime_error("Could not fill GPU buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::bufferCopy(gpu_buffer* src, size_t srcOffset, gpu_buffer* dst, size_t dstOffset, size_t size, EventDependence evd)
+{
+	SubmissionScope scope(sharedContext, evd);
+	
+	if (compute_copy_gpu(dst, dstOffset, src, srcOffset, size, NULL))
+	{
+		throw std::runtime_error("Could not copy GPU buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::bufferLoadFile(gpu_buffer* buf, size_t offset, const std::string& path, size_t fileOffset, size_t size, EventDependence evd)
+{
+	waitEvents(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	
+	if (compute_load_file(buf, offset, path.c_str(), fileOffset, size))
+	{
+		throw std::runtime_error("Could not load " + path + " into GPU buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::transferRectToGPU(gpu_buffer* buf, const compute_rect& rect, const void* data, EventDependence evd)
+{
+	waitEvents(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_copy_rect_to_gpu(buf, &rect, data);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferRectToGPU: rectangle exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferRectToGPU: could not map buffer");
+	}
+	
+	return scope.event();
+}
+
+Event ComputeInterface::transferRectFromGPU(gpu_buffer* buf, const compute_rect& rect, void* data, EventDependence evd)
 {
-	compute_copy_to_gpu(buf, offset, data, size);
+	waitEvents(evd);
+	
+	SubmissionScope scope(sharedContext, evd);
+	int ret = compute_copy_rect_from_gpu(buf, &rect, data);
+	
+	if (ret == -1)
+	{
+		throw std::out_of_range("transferRectFromGPU: rectangle exceeds buffer size");
+	}
+	else if (ret != 0)
+	{
+		throw std::runtime_error("transferRectFromGPU: could not map buffer");
+	}
+	
+	return scope.event();
 }
 
-void ComputeInterface::transferFromGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd)
+Event ComputeInterface::launch(std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd)
 {
-	compute_copy_from_gpu(buf, offset, data, size);
+	SubmissionScope scope(sharedContext, evd);
+	
+	dispatch(userData, threadOffset, blockDim, localSize, code, NULL, NULL);
+	
+	return scope.event();
 }
 
-void ComputeInterface::launch(std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd)
+void ComputeInterface::dispatch(const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, std::vector<gpu_buffer*>* buffers)
 {
+	if (kernel && localSize.empty())
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			localSize.push_back(kernel->info.local_size[i] ? kernel->info.local_size[i] : 1);
+		}
+		
+		blockDim.resize(3, 1);
+	}
+	
 	assert(localSize.size() == blockDim.size());
 	assert(localSize.size() <= 3);
 	assert(localSize.size() > 0);
@@ -91,8 +702,16 @@ void ComputeInterface::launch(std::vector<uint32_t> userData, std::vector<size_t
 	state.tmpring_waves = 0;
 	state.tmpring_wavesize = 0;
 	state.binary = code;
+	state.code_offset = 0;
+	state.buffers = buffers && !buffers->empty() ? &(*buffers)[0] : NULL;
+	state.num_buffers = buffers ? buffers->size() : 0;
 
-	int ret = compute_emit_compute_state(context, &state);
+	if (kernel && compute_kernel_setup_state(kernel, &state))
+	{
+		throw std::invalid_argument("launch: workgroup size or user data don't match the kernel");
+	}
+	
+	int ret = compute_emit_compute_state(context, &state, NULL);
 
 	if (ret != 0)
 	{
@@ -102,3 +721,100 @@ void ComputeInterface::launch(std::vector<uint32_t> userData, std::vector<size_t
 	compute_flush_caches(context);
 }
 
+Event ComputeInterface::launch(const std::vector<BufferView>& views, std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd)
+{
+	return launchViews(views, userData, threadOffset, blockDim, localSize, code, NULL, evd);
+}
+
+Event ComputeInterface::launch(const Kernel& kernel, const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, EventDependence evd)
+{
+	if (!kernel.kernel)
+	{
+		throw std::invalid_argument("launch: kernel was not loaded or is already freed");
+	}
+	
+	return launchViews(views, userData, threadOffset, blockDim, localSize, NULL, kernel.kernel, evd);
+}
+
+Event ComputeInterface::launchViews(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, const EventDependence& evd)
+{
+	std::vector<uint32_t> sgprs;
+	
+	for (unsigned i = 0; i < views.size(); i++)
+	{
+		const uint32_t* desc = views[i].descriptor();
+		sgprs.insert(sgprs.end(), desc, desc + 4);
+	}
+	
+	sgprs.insert(sgprs.end(), userData.begin(), userData.end());
+	
+	std::vector<gpu_buffer*> buffers;
+	
+	for (unsigned i = 0; i < views.size(); i++)
+	{
+		buffers.push_back(views[i].buffer());
+	}
+	
+	SubmissionScope scope(sharedContext, evd);
+	
+	dispatch(sgprs, threadOffset, blockDim, localSize, code, kernel, &buffers);
+	
+	return scope.event();
+}
+
+Event ComputeInterface::launchIndirect(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd)
+{
+	return launchTable(views, userData, threadOffset, blockDim, localSize, code, NULL, evd);
+}
+
+Event ComputeInterface::launchIndirect(const Kernel& kernel, const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, EventDependence evd)
+{
+	if (!kernel.kernel)
+	{
+		throw std::invalid_argument("launchIndirect: kernel was not loaded or is already freed");
+	}
+	
+	return launchTable(views, userData, threadOffset, blockDim, localSize, NULL, kernel.kernel, evd);
+}
+
+Event ComputeInterface::launchTable(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, const EventDependence& evd)
+{
+	std::vector<uint32_t> table;
+	
+	for (unsigned i = 0; i < views.size(); i++)
+	{
+		const uint32_t* desc = views[i].descriptor();
+		table.insert(table.end(), desc, desc + 4);
+	}
+	
+	table.insert(table.end(), userData.begin(), userData.end());
+	
+	if (table.empty())
+	{
+		table.push_back(0);
+	}
+	
+	uint64_t va = compute_upload_arguments(context, &table[0], table.size()*sizeof(uint32_t));
+	
+	if (!va)
+	{
+		throw std::runtime_error("Could not upload kernel arguments");
+	}
+	
+	std::vector<uint32_t> sgprs;
+	sgprs.push_back(va);
+	sgprs.push_back(va >> 32);
+	
+	std::vector<gpu_buffer*> buffers;
+	
+	for (unsigned i = 0; i < views.size(); i++)
+	{
+		buffers.push_back(views[i].buffer());
+	}
+	
+	SubmissionScope scope(sharedContext, evd);
+	
+	dispatch(sgprs, threadOffset, blockDim, localSize, code, kernel, &buffers);
+	
+	return scope.event();
+}
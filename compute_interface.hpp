@@ -2,40 +2,257 @@
 #define _COMPUTE_INTERFACE_HPP_
 #include <vector>
 #include <string>
+#include <memory>
+#include <initializer_list>
+#include <type_traits>
+#include <stdint.h>
 
 struct gpu_buffer;
+struct gpu_buffer_view;
 struct compute_context;
+struct compute_va_stats;
+struct compute_rect;
+struct compute_scatter_entry;
+struct compute_kernel;
+struct compute_kernel_info;
 
+struct EventState;
+class SubmissionScope;
+
+///Completion of an operation, returned by every ComputeInterface call that takes an EventDependence.
+///Copies share it. Default constructed events are complete. Events keep the device context alive, so they
+///can still be waited for or dropped after their ComputeInterface is destroyed.
+class Event
+{
+	std::shared_ptr<EventState> state;
+	friend class ComputeInterface;
+	friend class SubmissionScope;
+public:
+	Event();
+
+	///true once the GPU work retired and, for readbacks, the data is in the host buffer
+	bool ready() const;
+	void wait() const;
+};
+
+///Events an operation has to start after. GPU work waits for them on the GPU without blocking the host,
+///operations without dependencies may run concurrently with earlier ones on the same ring.
+///Blocking transfers wait for their dependencies on the host, the others only for readbacks into host memory they use.
 class EventDependence
 {
+	std::vector<Event> events;
+	friend class ComputeInterface;
+	friend class SubmissionScope;
+public:
+	EventDependence() {}
+	EventDependence(const Event& event) : events(1, event) {}
+	EventDependence(std::initializer_list<Event> list) : events(list) {}
+
+	void add(const Event& event) { events.push_back(event); }
+};
+
+///A range of a gpu_buffer with an element format, bound to kernels as a buffer resource (V#).
+///Copies share the cached descriptor.
+class BufferView
+{
+	std::shared_ptr<gpu_buffer_view> view;
+public:
+	///defaults describe 32 bit UINT elements
+	BufferView(gpu_buffer* buf, size_t offset, size_t size, unsigned stride = 4, int numFormat = 4, int dataFormat = 4);
+
+	gpu_buffer* buffer() const;
+	size_t offset() const;
+	size_t size() const;
+
+	///4 dwords, re-encoded only when the underlying buffer address changed
+	const uint32_t* descriptor() const;
+};
+
+///Host mapping of a byte range of a GTT, userptr or cpuAccess buffer, held until destruction.
+///Mapping does not synchronize: invalidate() before reading results of GPU work,
+///flush() before launching work that reads host writes. Neither copies data.
+class MappedRange
+{
+	gpu_buffer* buf;
+	char* ptr;
+	size_t off;
+	size_t len;
+public:
+	///size 0 maps up to the end of the buffer
+	MappedRange(gpu_buffer* buf, size_t offset = 0, size_t size = 0);
+	MappedRange(MappedRange&& other);
+	MappedRange& operator=(MappedRange&& other);
+	MappedRange(const MappedRange&) = delete;
+	MappedRange& operator=(const MappedRange&) = delete;
+	~MappedRange();
+
+	void* data() const { return ptr; }
+	size_t size() const { return len; }
+
+	void invalidate();
+	void flush();
+};
+
+///Typed view of a mapped range, iterators are plain pointers so std algorithms work in place.
+///Visible VRAM is write-combined, reading it back element by element is slow.
+template<typename T>
+class MappedSpan
+{
+	static_assert(std::is_trivially_copyable<T>::value, "MappedSpan elements are shared with the GPU bitwise");
+
+	MappedRange range;
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	///count 0 maps up to the end of the buffer
+	MappedSpan(gpu_buffer* buf, size_t first = 0, size_t count = 0) : range(buf, first*sizeof(T), count*sizeof(T)) {}
+
+	T* data() const { return static_cast<T*>(range.data()); }
+	size_t size() const { return range.size()/sizeof(T); }
+	bool empty() const { return size() == 0; }
+
+	T& operator[](size_t i) const { return data()[i]; }
+	iterator begin() const { return data(); }
+	iterator end() const { return data() + size(); }
+
+	void invalidate() { range.invalidate(); }
+	void flush() { range.flush(); }
+};
+
+///Code loaded once into the context's code heap with its launch metadata, copies share it.
+///The ComputeInterface owns it, it stays valid until kernelFree or the interface is destroyed.
+class Kernel
+{
+	compute_kernel* kernel;
+	friend class ComputeInterface;
+public:
+	Kernel() : kernel(NULL) {}
+
+	///address of the first instruction, for position dependent code
+	uint64_t address() const;
 };
 
 class ComputeInterface
 {
 	compute_context* context;
+	std::shared_ptr<compute_context> sharedContext; ///shared with the events, which may outlive the interface
+
+	static void completeReadbacks(const EventDependence& evd);
+	static void waitEvents(const EventDependence& evd);
+
+	///buffers NULL makes the launch depend on every buffer, including those in flight on the DMA ring
+	///kernel NULL launches code with conservative register and LDS settings, an empty localSize takes the kernel's
+	void dispatch(const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, std::vector<gpu_buffer*>* buffers);
+	Event launchViews(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, const EventDependence& evd);
+	Event launchTable(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, const compute_kernel* kernel, const EventDependence& evd);
 public:
 	ComputeInterface(std::string driName);
 	~ComputeInterface();
 
-	gpu_buffer* bufferAlloc(size_t size);
+	///allocations above the VRAM budget spill the least recently used buffers to GTT
+	void setMemoryBudget(size_t vramBytes, size_t gttBytes);
+
+	///moves idle buffers to close VA holes, their va changes, returns how many moved
+	int compactVA();
+	void vaStats(compute_va_stats* stats) const;
+
+	///tracks every buffer and prints a leak report once the interface and its last Event are destroyed
+	void enableAllocTrace(bool verbose = false);
+	///usage, peaks, size histogram and VA fragmentation to stderr
+	void printAllocReport() const;
+
+	///uploads the code once, launches of the kernel take their VGPR, SGPR, LDS and user SGPR settings from info
+	Kernel kernelLoad(const void* code, size_t size, const compute_kernel_info& info);
+	///releases the code range and empties kernel, launching it throws afterwards. Other copies must not be launched either.
+	void kernelFree(Kernel& kernel);
+
+	///cpuAccess keeps the buffer in CPU visible VRAM, others are transferred through GTT staging
+	gpu_buffer* bufferAlloc(size_t size, bool cpuAccess = false);
 	void bufferFree(gpu_buffer* buf);
 
-	void transferToGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd = EventDependence());
-	void transferFromGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd = EventDependence());
+	///wraps page aligned host memory without copying, the memory has to outlive the buffer
+	gpu_buffer* bufferImportHost(void* ptr, size_t size, bool readOnly = false);
+
+	///returns a dma-buf file descriptor owned by the caller
+	int bufferExport(gpu_buffer* buf);
+	///maps a dma-buf from another context or process, fd stays owned by the caller
+	gpu_buffer* bufferImport(int fd);
+
+	void* bufferMap(gpu_buffer* buf);
+	void bufferUnmap(gpu_buffer* buf);
+
+	///copies data into the transient arena and returns its GPU address.
+	///The memory is recycled once the next submission retired.
+	uint64_t uploadTransient(const void* data, size_t size, size_t alignment = 64);
+
+	///large transfers to VRAM stream through slots GTT chunks of chunkSize bytes,
+	///the host copy of one chunk overlaps the GPU copy of the previous
+	void setTransferChunking(size_t chunkSize, int slots);
+	///worker threads for host copies of 16M and more, 0 copies on the calling thread only
+	void setCopyThreads(int threads);
+
+	Event transferToGPU(gpu_buffer* buf, size_t offset, const void* data, size_t size, EventDependence evd = EventDependence());
+	Event transferFromGPU(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd = EventDependence());
+	///only the GPU copy is asynchronous. Uploads copy data into staging before returning, blocking while the
+	///staging slots are busy, so data can be reused right away. Buffers the CPU maps are written directly
+	///once their dependencies and earlier GPU work on them finished, their event is complete on return.
+	///Readback destinations have to stay valid until the event completed, waiting on it (or passing it to
+	///another transfer) is what puts the data in place.
+	Event transferToGPUAsync(gpu_buffer* buf, size_t offset, const void* data, size_t size, EventDependence evd = EventDependence());
+	Event transferFromGPUAsync(gpu_buffer* buf, size_t offset, void* data, size_t size, EventDependence evd = EventDependence());
+	///many small non-overlapping regions in one submission, data can be reused on return
+	Event transferScatterToGPU(gpu_buffer* buf, const std::vector<compute_scatter_entry>& entries, EventDependence evd = EventDependence());
+
+	///reads a file range (size 0: to the end) straight into the buffer, bypassing the page cache where possible
+	Event bufferLoadFile(gpu_buffer* buf, size_t offset, const std::string& path, size_t fileOffset = 0, size_t size = 0, EventDependence evd = EventDependence());
+
+	///sub-rectangles and sub-volumes with separate host and buffer pitches, no packing on the host
+	Event transferRectToGPU(gpu_buffer* buf, const compute_rect& rect, const void* data, EventDependence evd = EventDependence());
+	Event transferRectFromGPU(gpu_buffer* buf, const compute_rect& rect, void* data, EventDependence evd = EventDependence());
+
+	template<typename T>
+	Event transferToGPU(gpu_buffer* buf, size_t offset, const T& data, EventDependence evd = EventDependence())
+	{
+		return transferToGPU(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
+	}
+
+	template<typename T>
+	Event transferFromGPU(gpu_buffer* buf, size_t offset, T& data, EventDependence evd = EventDependence())
+	{
+		return transferFromGPU(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
+	}
 
 	template<typename T>
-	void transferToGPU(gpu_buffer* buf, size_t offset, const T& data, EventDependence evd = EventDependence())
+	Event transferToGPUAsync(gpu_buffer* buf, size_t offset, const T& data, EventDependence evd = EventDependence())
 	{
-		transferToGPU(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
+		return transferToGPUAsync(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
 	}
 
 	template<typename T>
-	void transferFromGPU(gpu_buffer* buf, size_t offset, const T& data, EventDependence evd = EventDependence())
+	Event transferFromGPUAsync(gpu_buffer* buf, size_t offset, T& data, EventDependence evd = EventDependence())
 	{
-		transferFromGPU(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
+		return transferFromGPUAsync(buf, offset, &data[0], data.size()*sizeof(data[0]), evd);
 	}
 
-	void launch(std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd = EventDependence());
+	///on-device initialization and copies, queued in order with launches
+	Event bufferFill(gpu_buffer* buf, size_t offset, size_t size, uint32_t pattern, EventDependence evd = EventDependence());
+	Event bufferCopy(gpu_buffer* src, size_t srcOffset, gpu_buffer* dst, size_t dstOffset, size_t size, EventDependence evd = EventDependence());
+
+	Event launch(std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd = EventDependence());
+
+	///descriptors of views are placed in the first user SGPRs, 4 per view, followed by userData.
+	///The kernel may only access the view buffers, so DMA transfers of other buffers keep running.
+	Event launch(const std::vector<BufferView>& views, std::vector<uint32_t> userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd = EventDependence());
+
+	///views and userData are written to a table in the transient arena and user SGPRs 0-1 hold its 64 bit address.
+	///The table holds the view descriptors (16 bytes each) followed by userData, kernels fetch them with SMRD loads.
+	Event launchIndirect(const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize, gpu_buffer* code, EventDependence evd = EventDependence());
+
+	///kernel launches, an empty localSize uses the kernel's required workgroup size
+	Event launch(const Kernel& kernel, const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize = std::vector<size_t>(), EventDependence evd = EventDependence());
+	Event launchIndirect(const Kernel& kernel, const std::vector<BufferView>& views, const std::vector<uint32_t>& userData, std::vector<size_t> threadOffset, std::vector<size_t> blockDim, std::vector<size_t> localSize = std::vector<size_t>(), EventDependence evd = EventDependence());
 };
 
 #endif
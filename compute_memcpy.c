@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "compute_memcpy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPUTE_MEMCPY_X86
+#endif
+
+#define COMPUTE_MEMCPY_NT_MIN 256 ///below this the streaming loop costs more than the stores save
+
+static void compute_memcpy_libc(void* dst, const void* src, size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+#ifdef COMPUTE_MEMCPY_X86
+///MOVNTDQA needs 16 byte aligned sources, the unaligned head and tail go through memcpy
+__attribute__((target("sse4.1")))
+static void compute_memcpy_from_wc_sse41(void* dst, const void* src, size_t size)
+{
+  char* d = dst;
+  const char* s = src;
+  size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+  
+  if (head > size)
+  {
+    head = size;
+  }
+  
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+  
+  ///4 loads per iteration use a whole 64 byte streaming load buffer
+  while (size >= 64)
+  {
+    __m128i x0 = _mm_stream_load_si128((__m128i*)(s + 0));
+    __m128i x1 = _mm_stream_load_si128((__m128i*)(s + 16));
+    __m128i x2 = _mm_stream_load_si128((__m128i*)(s + 32));
+    __m128i x3 = _mm_stream_load_si128((__m128i*)(s + 48));
+    
+    _mm_storeu_si128((__m128i*)(d + 0), x0);
+    _mm_storeu_si128((__m128i*)(d + 16), x1);
+    _mm_storeu_si128((__m128i*)(d + 32), x2);
+    _mm_storeu_si128((__m128i*)(d + 48), x3);
+    
+    d += 64;
+    s += 64;
+    size -= 64;
+  }
+  
+  while (size >= 16)
+  {
+    _mm_storeu_si128((__m128i*)d, _mm_stream_load_si128((__m128i*)s));
+    
+    d += 16;
+    s += 16;
+    size -= 16;
+  }
+  
+  memcpy(d, s, size);
+}
+#endif
+
+#ifdef COMPUTE_MEMCPY_X86
+///Stores need the alignment, so the head up to the first aligned destination byte is copied normally
+__attribute__((target("avx2")))
+static void compute_memcpy_to_wc_avx2(void* dst, const void* src, size_t size)
+{
+  char* d = dst;
+  const char* s = src;
+  size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+  
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+  
+  ///128 bytes fill two WC buffers completely
+  while (size >= 128)
+  {
+    __m256i y0 = _mm256_loadu_si256((const __m256i*)(s + 0));
+    __m256i y1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+    __m256i y2 = _mm256_loadu_si256((const __m256i*)(s + 64));
+    __m256i y3 = _mm256_loadu_si256((const __m256i*)(s + 96));
+    
+    _mm256_stream_si256((__m256i*)(d + 0), y0);
+    _mm256_stream_si256((__m256i*)(d + 32), y1);
+    _mm256_stream_si256((__m256i*)(d + 64), y2);
+    _mm256_stream_si256((__m256i*)(d + 96), y3);
+    
+    d += 128;
+    s += 128;
+    size -= 128;
+  }
+  
+  while (size >= 32)
+  {
+    _mm256_stream_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+    
+    d += 32;
+    s += 32;
+    size -= 32;
+  }
+  
+  memcpy(d, s, size);
+  _mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static void compute_memcpy_to_wc_sse2(void* dst, const void* src, size_t size)
+{
+  char* d = dst;
+  const char* s = src;
+  size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+  
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+  
+  while (size >= 64)
+  {
+    __m128i x0 = _mm_loadu_si128((const __m128i*)(s + 0));
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(s + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(s + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(s + 48));
+    
+    _mm_stream_si128((__m128i*)(d + 0), x0);
+    _mm_stream_si128((__m128i*)(d + 16), x1);
+    _mm_stream_si128((__m128i*)(d + 32), x2);
+    _mm_stream_si128((__m128i*)(d + 48), x3);
+    
+    d += 64;
+    s += 64;
+    size -= 64;
+  }
+  
+  while (size >= 16)
+  {
+    _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    
+    d += 16;
+    s += 16;
+    size -= 16;
+  }
+  
+  memcpy(d, s, size);
+  _mm_sfence();
+}
+#endif
+
+void compute_memcpy_to_wc(void* dst, const void* src, size_t size)
+{
+  static compute_memcpy_fn fn;
+  
+  if (!fn)
+  {
+    fn = compute_memcpy_libc;
+    
+#ifdef COMPUTE_MEMCPY_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+      fn = compute_memcpy_to_wc_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+      fn = compute_memcpy_to_wc_sse2;
+    }
+#endif
+  }
+  
+  if (size < COMPUTE_MEMCPY_NT_MIN)
+  {
+    memcpy(dst, src, size);
+#ifdef COMPUTE_MEMCPY_X86
+    ///WC stores sit in the fill buffers too, they have to be visible before the caller submits
+    _mm_sfence();
+#endif
+    return;
+  }
+  
+  fn(dst, src, size);
+}
+
+void compute_memcpy_from_wc(void* dst, const void* src, size_t size)
+{
+  static compute_memcpy_fn fn;
+  
+  if (!fn)
+  {
+    fn = compute_memcpy_libc;
+    
+#ifdef COMPUTE_MEMCPY_X86
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+      fn = compute_memcpy_from_wc_sse41;
+    }
+#endif
+  }
+  
+  fn(dst, src, size);
+}
+
+struct compute_copy_pool
+{
+  pthread_t* threads;
+  int num_threads;
+  
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  
+  ///current job, workers pick it up when generation changes
+  uint64_t generation;
+  compute_memcpy_fn fn;
+  char* dst;
+  const char* src;
+  size_t size;
+  size_t slice;
+  int pending; ///workers still copying
+  int quit;
+};
+
+struct compute_copy_worker
+{
+  struct compute_copy_pool* pool;
+  int index;
+};
+
+static void compute_copy_slice(int index, compute_memcpy_fn fn, char* dst, const char* src, size_t size, size_t slice)
+{
+  size_t begin = index*slice;
+  
+  if (begin < size)
+  {
+    fn(dst + begin, src + begin, size - begin < slice ? size - begin : slice);
+  }
+}
+
+static void* compute_copy_worker_main(void* arg)
+{
+  struct compute_copy_worker* w = arg;
+  struct compute_copy_pool* pool = w->pool;
+  int index = w->index;
+  uint64_t seen = 0;
+  
+  free(w);
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  for (;;)
+  {
+    while (!pool->quit && pool->generation == seen)
+    {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    
+    if (pool->quit)
+    {
+      break;
+    }
+    
+    seen = pool->generation;
+    
+    compute_memcpy_fn fn = pool->fn;
+    char* dst = pool->dst;
+    const char* src = pool->src;
+    size_t size = pool->size;
+    size_t slice = pool->slice;
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    compute_copy_slice(index, fn, dst, src, size, slice);
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    if (--pool->pending == 0)
+    {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+  
+  return NULL;
+}
+
+///Parses a sysfs cpulist into cpus, returns the number of entries
+static int compute_parse_cpulist(const char* list, int* cpus, int max)
+{
+  int n = 0;
+  
+  while (*list && n < max)
+  {
+    char* end;
+    long first = strtol(list, &end, 10);
+    long last = first;
+    
+    if (end == list)
+    {
+      break;
+    }
+    
+    if (*end == '-')
+    {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+    }
+    
+    for (; first <= last && n < max; first++)
+    {
+      cpus[n++] = first;
+    }
+    
+    list = *end == ',' ? end + 1 : end;
+  }
+  
+  return n;
+}
+
+struct compute_copy_pool* compute_copy_pool_create(int threads, const char* cpulist)
+{
+  struct compute_copy_pool* pool;
+  int cpus[CPU_SETSIZE];
+  int num_cpus = cpulist ? compute_parse_cpulist(cpulist, cpus, CPU_SETSIZE) : 0;
+  int i;
+  
+  if (threads < 1)
+  {
+    return NULL;
+  }
+  
+  pool = calloc(1, sizeof(struct compute_copy_pool));
+  pool->threads = calloc(threads, sizeof(pthread_t));
+  
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  
+  for (i = 0; i < threads; i++)
+  {
+    struct compute_copy_worker* w = malloc(sizeof(struct compute_copy_worker));
+    
+    w->pool = pool;
+    w->index = i + 1; ///slice 0 belongs to the caller
+    
+    if (pthread_create(&pool->threads[i], NULL, compute_copy_worker_main, w))
+    {
+      free(w);
+      break;
+    }
+    
+    if (num_cpus)
+    {
+      cpu_set_t set;
+      
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % num_cpus], &set);
+      pthread_setaffinity_np(pool->threads[i], sizeof(set), &set);
+    }
+    
+    pool->num_threads++;
+  }
+  
+  if (!pool->num_threads)
+  {
+    compute_copy_pool_destroy(pool);
+    return NULL;
+  }
+  
+  return pool;
+}
+
+void compute_copy_pool_destroy(struct compute_copy_pool* pool)
+{
+  int i;
+  
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  
+  for (i = 0; i < pool->num_threads; i++)
+  {
+    pthread_join(pool->threads[i], NULL);
+  }
+  
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+void compute_copy_pool_run(struct compute_copy_pool* pool, compute_memcpy_fn fn, void* dst, const void* src, size_t size)
+{
+  int parts = pool->num_threads + 1;
+  size_t slice = ((size + parts - 1) / parts + 4095) & ~(size_t)4095;
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  pool->fn = fn;
+  pool->dst = dst;
+  pool->src = src;
+  pool->size = size;
+  pool->slice = slice;
+  pool->pending = pool->num_threads;
+  pool->generation++;
+  
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  
+  compute_copy_slice(0, fn, dst, src, size, slice);
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  while (pool->pending)
+  {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+}
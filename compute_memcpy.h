@@ -0,0 +1,24 @@
+#ifndef COMPUTE_MEMCPY_H
+#define COMPUTE_MEMCPY_H
+#include <stddef.h>
+
+///Copies out of write-combined or uncached memory (VRAM mappings) with SSE4.1 streaming loads,
+///which fetch whole lines instead of one uncached access per load. Falls back to memcpy.
+void compute_memcpy_from_wc(void* dst, const void* src, size_t size);
+
+///Copies into write-combined memory with aligned AVX2 or SSE2 non-temporal stores, so every line
+///leaves the WC buffers whole. Ends with an sfence, the data is globally visible before a submission.
+void compute_memcpy_to_wc(void* dst, const void* src, size_t size);
+
+typedef void (*compute_memcpy_fn)(void* dst, const void* src, size_t size);
+
+struct compute_copy_pool;
+
+///Persistent worker threads for splitting huge copies. cpulist ("0-7,16-23" as in sysfs) pins the
+///workers, round robin, to the CPUs close to the device's memory controller, NULL leaves them unpinned.
+struct compute_copy_pool* compute_copy_pool_create(int threads, const char* cpulist);
+void compute_copy_pool_destroy(struct compute_copy_pool* pool);
+///Splits the copy into page aligned slices, one per worker plus one for the caller, returns when all are done
+void compute_copy_pool_run(struct compute_copy_pool* pool, compute_memcpy_fn fn, void* dst, const void* src, size_t size);
+
+#endif
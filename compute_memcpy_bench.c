@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "computesi.h"
+#include "compute_memcpy.h"
+
+#define BENCH_MIN_SIZE   (4*1024ull)
+#define BENCH_MAX_SIZE   (1024*1024*1024ull)
+#define BENCH_MIN_BYTES  (256*1024*1024ull) ///copied per size and routine, small sizes repeat more often
+
+typedef void (*bench_fn)(void* dst, const void* src, size_t size);
+
+static void bench_memcpy(void* dst, const void* src, size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+///best of 3 runs in GB/s
+static double bench_run(bench_fn fn, void* dst, const void* src, uint64_t size)
+{
+  uint64_t reps = BENCH_MIN_BYTES / size ? BENCH_MIN_BYTES / size : 1;
+  double best = 0;
+  int run;
+  uint64_t i;
+  
+  for (run = 0; run < 3; run++)
+  {
+    double start = bench_now();
+    double t;
+    
+    for (i = 0; i < reps; i++)
+    {
+      fn(dst, src, size);
+    }
+    
+    t = bench_now() - start;
+    
+    if (reps*size / t > best)
+    {
+      best = reps*size / t;
+    }
+  }
+  
+  return best / 1e9;
+}
+
+///Compares memcpy with compute_memcpy_to_wc. Without arguments the destination is host memory,
+///with a DRM device path it is a CPU visible VRAM buffer, which is what the upload routine is for.
+int main(int argc, char** argv)
+{
+  struct compute_context* ctx = NULL;
+  struct gpu_buffer* bo = NULL;
+  uint64_t max_size = BENCH_MAX_SIZE;
+  uint64_t size;
+  void* dst;
+  void* src;
+  
+  if (argc > 1)
+  {
+    ctx = compute_create_context(argv[1]);
+    
+    if (!ctx)
+    {
+      fprintf(stderr, "could not open %s\n", argv[1]);
+      return 1;
+    }
+    
+    ///the visible window is often only 256M, allocations that don't fit it fall back to GTT instead of failing
+    for (; max_size >= BENCH_MIN_SIZE; max_size /= 2)
+    {
+      bo = compute_alloc_gpu_buffer(ctx, max_size, RADEON_DOMAIN_VRAM, 4096, COMPUTE_BUFFER_CPU_ACCESS);
+      
+      if (bo && bo->domain == RADEON_DOMAIN_VRAM)
+      {
+        break;
+      }
+      
+      if (bo)
+      {
+        compute_free_gpu_buffer(bo);
+        bo = NULL;
+      }
+    }
+    
+    if (!bo)
+    {
+      fprintf(stderr, "no CPU visible VRAM buffer of %llu bytes or more fits\n", BENCH_MIN_SIZE);
+      compute_free_context(ctx);
+      return 1;
+    }
+    
+    dst = compute_map_gpu_buffer(bo);
+    
+    printf("destination: visible VRAM, %lu bytes\n", max_size);
+  }
+  else
+  {
+    dst = malloc(max_size);
+  }
+  
+  src = malloc(max_size);
+  
+  if (!dst || !src)
+  {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  
+  memset(src, 0x5A, max_size);
+  
+  printf("%12s %12s %12s\n", "size", "memcpy GB/s", "to_wc GB/s");
+  
+  for (size = BENCH_MIN_SIZE; size <= max_size; size *= 2)
+  {
+    double libc = bench_run(bench_memcpy, dst, src, size);
+    double wc = bench_run(compute_memcpy_to_wc, dst, src, size);
+    
+    printf("%12lu %12.2f %12.2f\n", size, libc, wc);
+  }
+  
+  free(src);
+  
+  if (ctx)
+  {
+    compute_unmap_gpu_buffer(bo);
+    compute_free_context(ctx);
+  }
+  else
+  {
+    free(dst);
+  }
+  
+  return 0;
+}
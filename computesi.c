@@ -1,16 +1,67 @@
+#define _GNU_SOURCE ///O_DIRECT
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <execinfo.h>
+#include <dlfcn.h>
 #include "computesi.h"
+#include "compute_memcpy.h"
 
 #define PKT3C(a, b, c) (PKT3(a, b, c) | 1 << 1)
 
+#define COMPUTE_VA_FRAGMENT_SIZE       (64*1024)
+#define COMPUTE_VA_LARGE_FRAGMENT_SIZE (2*1024*1024)
+
+#define COMPUTE_ARENA_SIZE    (4*1024*1024)
+#define COMPUTE_ARG_ALIGNMENT 64
+
+#define COMPUTE_FENCE_DW 12 ///dwords compute_submit appends to every IB, the DMA ring fence includes padding
+
+#define COMPUTE_STAGING_CHUNK     (1024*1024)
+#define COMPUTE_STAGING_SLOTS     4
+#define COMPUTE_STAGING_THRESHOLD (64*1024) ///smaller transfers map the buffer directly
+#ifndef PKT3_WRITE_DATA
+#define PKT3_WRITE_DATA             0x37
+#endif
+
+#define WRITE_DATA_DST_SEL(x)       (((x) & 0xF) << 8)
+#define WRITE_DATA_DST_MEM          5
+#define WRITE_DATA_WR_CONFIRM       (1u << 20)
+
+#define WAIT_REG_MEM_GEQUAL         5
+#define WAIT_REG_MEM_MEM_SPACE(x)   (((x) & 0x3) << 4)
+
+#define COMPUTE_LOADER_CHUNK (4*1024*1024)
+#define COMPUTE_LOADER_SLOTS 4
+
+#define COMPUTE_RECT_MAX_REGIONS 1024 ///rows per staged rect submission, bounds the IB size
+#define COMPUTE_READBACK_THRESHOLD 4096    ///CPU reads of VRAM are uncached, so readback stages much earlier
+
+#define COMPUTE_COPY_THREADS            3
+#define COMPUTE_COPY_PARALLEL_THRESHOLD (16*1024*1024) ///one core stops keeping up with PCIe around here
+
+#define COMPUTE_CODE_HEAP_SIZE  (1024*1024)
+#define COMPUTE_CODE_ALIGNMENT  256 ///COMPUTE_PGM_LO holds address bits 8 and up
+
+#define COMPUTE_FENCE_SPIN_NS 50000 ///fence waits poll this long before blocking on the whole ring
+
+#define EVENT_TYPE(x)   ((x) << 0)
+#define EVENT_INDEX(x)  ((x) << 8)
+#define EOP_INT_SEL(x)  ((x) << 24)
+#define EOP_DATA_SEL(x) ((x) << 29)
+
+#define EVENT_TYPE_CACHE_FLUSH_AND_INV_TS_EVENT 0x14
+
 #define set_compute_reg(reg, val) do {\
   assert(reg >= SI_SH_REG_OFFSET && reg <= SI_SH_REG_END); \
   buf[cdw++] = PKT3C(PKT3_SET_SH_REG, 1, 0); \
@@ -49,11 +100,66 @@ struct drm_radeon_gem_va {
 #define DRM_RADEON_GEM_VA   0x2b
 #endif
 
+#ifndef RADEON_GEM_USERPTR_READONLY
+
+#define RADEON_GEM_USERPTR_READONLY (1 << 0)
+#define RADEON_GEM_USERPTR_ANONONLY (1 << 1)
+#define RADEON_GEM_USERPTR_VALIDATE (1 << 2)
+#define RADEON_GEM_USERPTR_REGISTER (1 << 3)
+
+struct drm_radeon_gem_userptr {
+    uint64_t    addr;
+    uint64_t    size;
+    uint32_t    flags;
+    uint32_t    handle;
+};
+
+#define DRM_RADEON_GEM_USERPTR  0x2d
+#endif
+
+#ifndef DRM_RDWR
+#define DRM_RDWR O_RDWR
+#endif
+
 #ifndef RADEON_INFO_VA_START
   #define RADEON_INFO_VA_START          0x0e
   #define RADEON_INFO_IB_VM_MAX_SIZE    0x0f
 #endif
 
+#ifndef RADEON_GEM_CPU_ACCESS
+#define RADEON_GEM_CPU_ACCESS       (1 << 3)
+#define RADEON_GEM_NO_CPU_ACCESS    (1 << 4)
+#endif
+
+#ifndef PKT3_CP_DMA
+#define PKT3_CP_DMA                 0x41
+#endif
+
+#define CP_DMA_SRC_SEL(x)           (((x) & 0x3) << 29)
+#define CP_DMA_CP_SYNC              (1u << 31)
+#define CP_DMA_BYTE_COUNT(x)        ((x) & 0x1FFFFF)
+#define CP_DMA_MAX_BYTES            (1024*1024) ///per packet, keeps chunks aligned below the 21 bit limit
+
+#ifndef RADEON_CS_RING_DMA
+#define RADEON_CS_RING_DMA          2
+#endif
+
+#ifndef RADEON_INFO_RING_WORKING
+#define RADEON_INFO_RING_WORKING    0x15
+#endif
+
+#define DMA_PACKET(cmd, b, t, s, n) ((((cmd) & 0xF) << 28) | (((b) & 0x1) << 26) | \
+                                     (((t) & 0x1) << 23) | (((s) & 0x1) << 22) | ((n) & 0xFFFFF))
+#define DMA_PACKET_WRITE            0x2
+#define DMA_PACKET_COPY             0x3
+#define DMA_PACKET_NOP              0xf
+#define DMA_COPY_MAX_BYTES          0xFFFF8 ///byte count field is 20 bits, kept dword aligned
+
+#ifndef RADEON_INFO_VRAM_USAGE
+  #define RADEON_INFO_VRAM_USAGE        0x1e
+  #define RADEON_INFO_GTT_USAGE         0x1f
+#endif
+
 struct cs_reloc_gem {
     uint32_t    handle;
     uint32_t    read_domain;
@@ -61,11 +167,24 @@ struct cs_reloc_gem {
     uint32_t    flags;
 };
 
+static const uint32_t compute_radeon_ring[COMPUTE_RING_COUNT] = {
+  RADEON_CS_RING_COMPUTE,
+  RADEON_CS_RING_DMA
+};
+
+#define COMPUTE_ALL_BUFFERS -1 ///num_bos of compute_submit: reference every user buffer of the context
+
+static int compute_submit(struct compute_context* ctx, int ring, int cs_id, unsigned* buf, int cdw, struct gpu_buffer* const* bos, int num_bos, struct compute_fence* fence);
+static void compute_account(struct gpu_buffer* bo, int sign);
+static void compute_print_leaks(const struct compute_context* ctx);
+
 struct compute_context* compute_create_context(const char* drm_devfile)
 {
   struct drm_radeon_info ginfo;
+  struct drm_radeon_gem_info gem_info;
+  int i;
   assert(drmAvailable());
-  struct compute_context* ctx = malloc(sizeof(struct compute_context));
+  struct compute_context* ctx = calloc(1, sizeof(struct compute_context));
   
   ctx->fd = open(drm_devfile, O_RDWR, 0);
   
@@ -101,61 +220,153 @@ struct compute_context* compute_create_context(const char* drm_devfile)
   
   printf("reserved mem: 0x%lx vm size: 0x%lx pages\n", reserved_mem, max_vm_size);
   
+  memset(&gem_info, 0, sizeof(gem_info));
+  
+  if (drmCommandWriteRead(ctx->fd, DRM_RADEON_GEM_INFO, &gem_info, sizeof(gem_info)) == 0)
+  {
+    ctx->vram.size = gem_info.vram_size;
+    ctx->gtt.size = gem_info.gart_size;
+    ctx->vram_visible_size = gem_info.vram_visible;
+  }
+  
+  ///without device totals the budgets don't limit anything
+  ctx->vram.budget = ctx->vram.size ? ctx->vram.size : ~(uint64_t)0;
+  ctx->gtt.budget = ctx->gtt.size ? ctx->gtt.size : ~(uint64_t)0;
+  
+  const char* trace = getenv("COMPUTE_TRACE_ALLOCS");
+  
+  if (trace && atoi(trace) > 0)
+  {
+    compute_enable_alloc_trace(ctx, atoi(trace) > 1);
+  }
+  
   ctx->vm_pool = malloc(sizeof(struct pool_node));
   ctx->vm_pool->va = 0;
   ctx->vm_pool->size = reserved_mem+4096; ///reserved VM area by the driver 
   ctx->vm_pool->prev = NULL;
   ctx->vm_pool->next = NULL;
+  
+  ctx->arena = NULL;
+  ctx->staging_chunk = COMPUTE_STAGING_CHUNK;
+  ctx->staging_slots = COMPUTE_STAGING_SLOTS;
+  
+  const char* copy_threads = getenv("COMPUTE_COPY_THREADS");
+  ctx->copy_threads = copy_threads ? atoi(copy_threads) : COMPUTE_COPY_THREADS;
+  
+  uint32_t dma_working = RADEON_CS_RING_DMA;
+  
+  ginfo.request = RADEON_INFO_RING_WORKING;
+  ginfo.value = (uintptr_t)&dma_working;
+  
+  ctx->dma_ring = drmCommandWriteRead(ctx->fd, DRM_RADEON_INFO, &ginfo, sizeof(ginfo)) == 0 && dma_working;
+  
+  for (i = 0; i < COMPUTE_RING_COUNT; i++)
+  {
+    struct gpu_buffer* fence_bo = compute_alloc_gpu_buffer(ctx, 4096, RADEON_DOMAIN_GTT, 4096, COMPUTE_BUFFER_INTERNAL);
+    
+    if (!fence_bo)
+    {
+      compute_free_context(ctx);
+      return NULL;
+    }
+    
+    ctx->rings[i].fence_bo = fence_bo;
+    ctx->rings[i].fence_ptr = compute_map_gpu_buffer(fence_bo);
+    ctx->rings[i].last_seq = 0;
+    
+    if (!ctx->rings[i].fence_ptr)
+    {
+      compute_free_context(ctx);
+      return NULL;
+    }
+  }
 
   return ctx;
 }
 
 void compute_free_context(struct compute_context* ctx)
 {
+  int i;
+  
+  if (ctx->trace)
+  {
+    compute_print_leaks(ctx);
+  }
+  
+  if (ctx->arena)
+  {
+    compute_free_arena(ctx->arena);
+  }
+  
+  for (i = 0; i < COMPUTE_RING_COUNT; i++)
+  {
+    if (ctx->rings[i].fence_ptr)
+    {
+      compute_unmap_gpu_buffer(ctx->rings[i].fence_bo);
+    }
+  }
+  
+  while (ctx->code_heaps)
+  {
+    struct compute_code_heap* heap = ctx->code_heaps;
+    
+    while (heap->kernels)
+    {
+      compute_free_kernel(heap->kernels);
+    }
+    
+    ctx->code_heaps = heap->next;
+    free(heap);
+  }
+  
   while (ctx->vm_pool->next)
   {
     compute_free_gpu_buffer(ctx->vm_pool->next->bo);
   }
   
   free(ctx->vm_pool);
+  free(ctx->trace);
+  
+  if (ctx->copy_pool)
+  {
+    compute_copy_pool_destroy(ctx->copy_pool);
+  }
+  
   close(ctx->fd);
   free(ctx);
 }
 
-uint64_t compute_pool_alloc(struct compute_context* ctx, uint64_t size, int alignment, struct gpu_buffer* bo)
+uint64_t compute_pool_alloc(struct compute_context* ctx, uint64_t size, uint64_t alignment, struct gpu_buffer* bo)
 {
   struct pool_node *n;
   assert((size & 4095) == 0);
+  assert((alignment & (alignment - 1)) == 0);
+  
+  if (alignment < 4096)
+  {
+    alignment = 4096;
+  }
 
   for (n = ctx->vm_pool; n; n = n->next)
   {
-    if (n->next)
-    {
-      if ((int64_t)n->next->va - n->va - n->size > size && alignment <= 4096)
-      {
-        struct pool_node* n2 = malloc(sizeof(struct pool_node));
-        
-        n2->bo = bo;
-        n2->va = n->va + n->size;
-        n2->size = size;
-        n2->prev = n;
-        n2->next = n->next;
-        n->next->prev = n2;
-        n->next = n2;
-        
-        return n2->va;
-      }
-    }
-    else
+    uint64_t va = (n->va + n->size + alignment - 1) & ~(alignment - 1);
+    
+    if (!n->next || va + size <= n->next->va)
     {
       struct pool_node* n2 = malloc(sizeof(struct pool_node));
       
       n2->bo = bo;
-      n2->va = n->va + n->size + 4096;
+      n2->va = va;
       n2->size = size;
-      n->next = n2;
       n2->prev = n;
-      n2->next = NULL;
+      n2->next = n->next;
+      
+      if (n->next)
+      {
+        n->next->prev = n2;
+      }
+      
+      n->next = n2;
       
       return n2->va;
     }
@@ -200,9 +411,7 @@ static int compute_vm_map(struct compute_context* ctx, uint64_t vm_addr, uint32_
   va.handle = handle;
   va.vm_id = vm_id;
   va.operation = RADEON_VA_MAP;
-  va.flags = flags |
-             RADEON_VM_PAGE_READABLE |
-             RADEON_VM_PAGE_WRITEABLE;
+  va.flags = flags | RADEON_VM_PAGE_READABLE;
              
   va.offset = vm_addr;
   
@@ -226,12 +435,11 @@ static int compute_vm_map(struct compute_context* ctx, uint64_t vm_addr, uint32_
 
 int compute_vm_remap(struct gpu_buffer* bo)
 {
-  return compute_vm_map(bo->ctx, bo->va, bo->handle, 0, RADEON_VM_PAGE_SNOOPED);
+  return compute_vm_map(bo->ctx, bo->va, bo->handle, 0, bo->vm_flags);
 }
 
 static int compute_vm_unmap(struct compute_context* ctx, uint64_t vm_addr, uint32_t handle, int vm_id)
 {
-  return 0; //WARNING
   struct drm_radeon_gem_va va;
   int r;
   
@@ -255,373 +463,3113 @@ static int compute_vm_unmap(struct compute_context* ctx, uint64_t vm_addr, uint3
   return 0;
 }
 
-static struct cs_reloc_gem* compute_create_reloc_table(const struct compute_context* ctx, int* size)
+static void compute_reloc_add(struct cs_reloc_gem* relocs, int* size, const struct gpu_buffer* bo, int unique, int write)
+{
+  int i;
+  
+  if (unique)
+  {
+    for (i = 0; i < *size; i++)
+    {
+      if (relocs[i].handle == bo->handle)
+      {
+        return;
+      }
+    }
+  }
+  
+  relocs[*size].handle = bo->handle;
+  relocs[*size].read_domain = bo->domain;
+  relocs[*size].write_domain = write ? bo->domain : 0;
+  relocs[*size].flags = 0;
+  (*size)++;
+}
+
+///The kernel orders submissions by the buffers they share, so a submission only lists what it touches:
+///the fence buffers, the arena on the compute ring, and bos (every user buffer and bos[0] for COMPUTE_ALL_BUFFERS).
+///Fence buffers are listed read only, the kernel would otherwise order every submission on one ring
+///after those on the others that polled its fence.
+static struct cs_reloc_gem* compute_create_reloc_table(const struct compute_context* ctx, int ring, struct gpu_buffer* const* bos, int num_bos, int* size)
 {
   struct cs_reloc_gem* relocs = NULL;
   struct pool_node *n;
-  int i = 0;
+  int max = COMPUTE_RING_COUNT + 1;
+  int i;
   
-  for (n = ctx->vm_pool->next; n; n = n->next)
+  if (num_bos == COMPUTE_ALL_BUFFERS)
   {
-    (*size)++;
+    for (n = ctx->vm_pool->next; n; n = n->next)
+    {
+      max++;
+    }
+    
+    max++;
   }
-  
-  if (*size == 0)
+  else
   {
-    return NULL;
+    max += num_bos;
   }
   
-  relocs = calloc(*size, sizeof(struct cs_reloc_gem));
+  relocs = calloc(max, sizeof(struct cs_reloc_gem));
+  *size = 0;
   
-  i = 0;
+  for (i = 0; i < COMPUTE_RING_COUNT; i++)
+  {
+    compute_reloc_add(relocs, size, ctx->rings[i].fence_bo, 0, 0);
+  }
   
-  for (n = ctx->vm_pool->next; n; n = n->next)
+  if (ring == COMPUTE_RING_COMPUTE && ctx->arena)
+  {
+    compute_reloc_add(relocs, size, ctx->arena->bo, 0, 1);
+  }
+  
+  if (num_bos == COMPUTE_ALL_BUFFERS)
+  {
+    ///internal buffers belong to other rings or are listed above
+    for (n = ctx->vm_pool->next; n; n = n->next)
+    {
+      if (!(n->bo->flags & COMPUTE_BUFFER_INTERNAL))
+      {
+        compute_reloc_add(relocs, size, n->bo, 0, 1);
+      }
+    }
+    
+    ///bos may add one buffer to all of them, e.g. an internal code heap
+    if (bos && (bos[0]->flags & COMPUTE_BUFFER_INTERNAL))
+    {
+      compute_reloc_add(relocs, size, bos[0], 0, 1);
+    }
+  }
+  else
   {
-    relocs[i].handle = n->bo->handle;
-    relocs[i].read_domain = n->bo->domain;
-    relocs[i].write_domain = n->bo->domain;
-    relocs[i].flags = 0;
-    i++;
+    for (i = 0; i < num_bos; i++)
+    {
+      compute_reloc_add(relocs, size, bos[i], 1, 1);
+    }
   }
   
   return relocs;
 }
 
-void compute_free_gpu_buffer(struct gpu_buffer* bo)
+static uint64_t compute_time_ns(void)
 {
-  struct drm_gem_close args;
+  struct timespec ts;
   
-  if (bo->va)
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int compute_trace_bucket(uint64_t size)
+{
+  int b = 0;
+  
+  for (size = (size - 1) >> 12; size && b < COMPUTE_TRACE_BUCKETS - 1; size >>= 1)
   {
-    compute_pool_free(bo->ctx, bo->va);
-    compute_vm_unmap(bo->ctx, bo->va, bo->handle, 0);
+    b++;
   }
   
-  memset(&args, 0, sizeof(args));
-  args.handle = bo->handle;
-  drmIoctl(bo->ctx->fd, DRM_IOCTL_GEM_CLOSE, &args); 
-  free(bo);
+  return b;
 }
 
+static const char* compute_domain_name(uint32_t domain)
+{
+  switch (domain)
+  {
+    case RADEON_DOMAIN_VRAM: return "VRAM";
+    case RADEON_DOMAIN_GTT: return "GTT";
+    default: return "?";
+  }
+}
 
-struct gpu_buffer* compute_alloc_gpu_buffer(struct compute_context* ctx, int size, int domain, int alignment)
+///Prints the recorded callers as symbol+offset, or module+offset for addr2line when the symbol isn't exported
+static void compute_trace_print_stack(FILE* out, const struct gpu_buffer* bo)
 {
-  struct drm_radeon_gem_create args;
-  struct gpu_buffer* buf = calloc(1, sizeof(struct gpu_buffer));
+  int i;
   
-  memset(&args, 0, sizeof(args));
-  args.size = size;
-  args.alignment = alignment;
-  args.initial_domain = domain;
+  for (i = 0; i < COMPUTE_TRACE_FRAMES && bo->alloc_stack[i]; i++)
+  {
+    Dl_info info;
+    const char* sep = i ? " <- " : "";
+    
+    if (dladdr(bo->alloc_stack[i], &info) && info.dli_sname)
+    {
+      fprintf(out, "%s%s+0x%lx", sep, info.dli_sname, (uintptr_t)bo->alloc_stack[i] - (uintptr_t)info.dli_saddr);
+    }
+    else if (dladdr(bo->alloc_stack[i], &info) && info.dli_fname)
+    {
+      fprintf(out, "%s%s+0x%lx", sep, info.dli_fname, (uintptr_t)bo->alloc_stack[i] - (uintptr_t)info.dli_fbase);
+    }
+    else
+    {
+      fprintf(out, "%s%p", sep, bo->alloc_stack[i]);
+    }
+  }
+}
+
+///not inlined, the frames it skips have to be its own and the allocating function's
+static __attribute__((noinline)) void compute_trace_alloc(struct gpu_buffer* bo)
+{
+  struct compute_alloc_trace* t = bo->ctx->trace;
+  void* frames[COMPUTE_TRACE_FRAMES + 2];
+  int n;
   
-  if (drmCommandWriteRead(ctx->fd, DRM_RADEON_GEM_CREATE, &args, sizeof(args)))
+  if (!t)
   {
-    fprintf(stderr, "radeon: Failed to allocate a buffer:\n");
-    fprintf(stderr, "radeon:    size      : %d bytes\n", size);
-    fprintf(stderr, "radeon:    alignment : %d bytes\n", alignment);
-    fprintf(stderr, "radeon:    domains   : %d\n", domain);
-    return NULL;
+    return;
   }
   
-  fprintf(stderr, "handle: %i\n", args.handle);
+  ///wrappers like ComputeInterface::bufferAlloc show their caller too
+  n = backtrace(frames, COMPUTE_TRACE_FRAMES + 2) - 2;
+  memset(bo->alloc_stack, 0, sizeof(bo->alloc_stack));
   
-  buf->ctx = ctx;
-  buf->alignment = args.alignment;
-  buf->handle = args.handle;
-  buf->domain = args.initial_domain;
-  buf->flags = 0;
-  buf->size = size;
+  if (n > 0)
+  {
+    memcpy(bo->alloc_stack, frames + 2, n*sizeof(void*));
+  }
   
-  buf->va_size = ((int)((size + 4095) / 4096)) * 4096;
-        
-  buf->va = compute_pool_alloc(ctx, buf->va_size, buf->alignment, buf);
-                                      
-  if (compute_vm_map(ctx, buf->va, buf->handle, 0, RADEON_VM_PAGE_SNOOPED))
+  bo->alloc_ns = compute_time_ns();
+  
+  t->allocs++;
+  t->live += bo->gem_size;
+  t->live_count++;
+  t->histogram[compute_trace_bucket(bo->size)]++;
+  
+  if (t->live > t->peak)
   {
-    compute_pool_free(ctx, buf->va);
-    buf->va = 0;
-    compute_free_gpu_buffer(buf);
-    return NULL;
+    t->peak = t->live;
   }
   
-  return buf;
+  if (t->live_count > t->peak_count)
+  {
+    t->peak_count = t->live_count;
+  }
+  
+  if (t->verbose)
+  {
+    fprintf(stderr, "radeon: alloc 0x%08X %lu bytes %s va 0x%lx from ", bo->handle, bo->size, compute_domain_name(bo->domain), bo->va);
+    compute_trace_print_stack(stderr, bo);
+    fprintf(stderr, "\n");
+  }
 }
 
-int compute_bo_wait(struct gpu_buffer *boi)
+static void compute_trace_free(struct gpu_buffer* bo)
 {
-    struct drm_radeon_gem_wait_idle args;
-    int ret;
-    
-    /* Zero out args to make valgrind happy */
-    memset(&args, 0, sizeof(args));
-    args.handle = boi->handle;
-    do {
-        ret = drmCommandWriteRead(boi->ctx->fd, DRM_RADEON_GEM_WAIT_IDLE,
-                                  &args, sizeof(args));
-    } while (ret == -EBUSY);
-    return ret;
+  struct compute_alloc_trace* t = bo->ctx->trace;
+  uint64_t lifetime;
+  
+  ///buffers from before tracing was enabled were never counted
+  if (!t || !bo->alloc_ns)
+  {
+    return;
+  }
+  
+  lifetime = compute_time_ns() - bo->alloc_ns;
+  
+  t->frees++;
+  t->live -= bo->gem_size;
+  t->live_count--;
+  t->lifetime_ns += lifetime;
+  
+  if (t->verbose)
+  {
+    fprintf(stderr, "radeon: free 0x%08X %lu bytes after %.3f ms\n", bo->handle, bo->size, lifetime / 1e6);
+  }
 }
 
-void compute_flush_caches(const struct compute_context* ctx)
+int compute_enable_alloc_trace(struct compute_context* ctx, int verbose)
 {
-  struct drm_radeon_cs cs;
-  unsigned buf[1024];
-  int cdw = 0;
-  uint64_t chunk_array[5];
-  struct drm_radeon_cs_chunk chunks[5];
-  uint32_t flags[3];
-  struct cs_reloc_gem* relocs;
-
-  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
-  buf[cdw++] = S_0085F0_TCL1_ACTION_ENA(1) |
-               S_0085F0_SH_ICACHE_ACTION_ENA(1) |
-               S_0085F0_SH_KCACHE_ACTION_ENA(1) |
-               S_0085F0_TC_ACTION_ENA(1);
-
-  buf[cdw++] = 0xffffffff;
-  buf[cdw++] = 0;
-  buf[cdw++] = 0xA;
-
-  flags[0] = RADEON_CS_USE_VM;
-  flags[1] = RADEON_CS_RING_COMPUTE;
+  if (!ctx->trace)
+  {
+    ctx->trace = calloc(1, sizeof(struct compute_alloc_trace));
+    
+    if (!ctx->trace)
+    {
+      return -1;
+    }
+  }
   
-  chunks[0].chunk_id = RADEON_CHUNK_ID_FLAGS;
-  chunks[0].length_dw = 2;
-  chunks[0].chunk_data =  (uint64_t)(uintptr_t)&flags[0];
+  ctx->trace->verbose = verbose;
+  
+  return 0;
+}
 
-  #define RELOC_SIZE (sizeof(struct cs_reloc_gem) / sizeof(uint32_t))
+void compute_print_alloc_report(const struct compute_context* ctx, FILE* out)
+{
+  const struct compute_alloc_trace* t = ctx->trace;
+  struct compute_va_stats va;
+  int i;
   
-  int reloc_num = 0;
-  relocs = compute_create_reloc_table(ctx, &reloc_num);
+  fprintf(out, "radeon: VRAM used %lu peak %lu, GTT used %lu peak %lu bytes\n", ctx->vram.used, ctx->vram.peak, ctx->gtt.used, ctx->gtt.peak);
   
-  chunks[1].chunk_id = RADEON_CHUNK_ID_RELOCS;
-  chunks[1].length_dw = reloc_num*RELOC_SIZE;
-  chunks[1].chunk_data =  (uint64_t)(uintptr_t)relocs;
-
-  chunks[2].chunk_id = RADEON_CHUNK_ID_IB;
-  chunks[2].length_dw = cdw;
-  chunks[2].chunk_data =  (uint64_t)(uintptr_t)&buf[0];  
+  compute_get_va_stats(ctx, &va);
+  fprintf(out, "radeon: VA end 0x%lx, %lu bytes used, %lu free in %u holes, largest hole %lu\n", va.end, va.used, va.free, va.holes, va.largest_hole);
+  
+  if (!t)
+  {
+    return;
+  }
+  
+  fprintf(out, "radeon: %lu allocations, %lu frees, %u live buffers with %lu bytes, peak %u buffers with %lu bytes\n",
+          t->allocs, t->frees, t->live_count, t->live, t->peak_count, t->peak);
+  
+  if (t->frees)
+  {
+    fprintf(out, "radeon: average lifetime %.3f ms\n", t->lifetime_ns / 1e6 / t->frees);
+  }
+  
+  for (i = 0; i < COMPUTE_TRACE_BUCKETS; i++)
+  {
+    if (t->histogram[i])
+    {
+      int last = i == COMPUTE_TRACE_BUCKETS - 1;
+      
+      fprintf(out, "radeon:   %s %8lu KiB: %u\n", last ? "> " : "<=", 4ul << (last ? i - 1 : i), t->histogram[i]);
+    }
+  }
+}
+
+///Everything the user allocated and didn't free, internal buffers belong to the context
+static void compute_print_leaks(const struct compute_context* ctx)
+{
+  const struct pool_node* n;
+  uint64_t now = compute_time_ns();
+  uint64_t bytes = 0;
+  int count = 0;
+  
+  for (n = ctx->vm_pool->next; n; n = n->next)
+  {
+    const struct gpu_buffer* bo = n->bo;
+    
+    if (bo->flags & COMPUTE_BUFFER_INTERNAL)
+    {
+      continue;
+    }
+    
+    if (bo->alloc_ns)
+    {
+      fprintf(stderr, "radeon: leaked buffer 0x%08X %lu bytes %s va 0x%lx, alive %.3f ms, from ",
+              bo->handle, bo->size, compute_domain_name(bo->domain), bo->va, (now - bo->alloc_ns) / 1e6);
+      compute_trace_print_stack(stderr, bo);
+      fprintf(stderr, "\n");
+    }
+    else
+    {
+      fprintf(stderr, "radeon: leaked buffer 0x%08X %lu bytes %s va 0x%lx, allocated before tracing\n",
+              bo->handle, bo->size, compute_domain_name(bo->domain), bo->va);
+    }
+    
+    bytes += bo->size;
+    count++;
+  }
+  
+  if (count)
+  {
+    fprintf(stderr, "radeon: %i buffers with %lu bytes leaked\n", count, bytes);
+  }
+  
+  compute_print_alloc_report(ctx, stderr);
+}
+
+void compute_free_gpu_buffer(struct gpu_buffer* bo)
+{
+  struct drm_gem_close args;
+  
+  if (bo->map_count)
+  {
+    fprintf(stderr, "radeon: freeing buffer 0x%08X with %i outstanding mappings\n", bo->handle, bo->map_count);
+  }
+  
+  if (bo->cpu_ptr && !(bo->flags & COMPUTE_BUFFER_USERPTR))
+  {
+    munmap(bo->cpu_ptr, bo->size);
+  }
+  
+  if (bo->va)
+  {
+    ///GEM_CLOSE drops the mapping together with the last handle, only the VA range has to be returned
+    compute_pool_free(bo->ctx, bo->va);
+  }
+  
+  compute_account(bo, -1);
+  compute_trace_free(bo);
+  
+  memset(&args, 0, sizeof(args));
+  args.handle = bo->handle;
+  drmIoctl(bo->ctx->fd, DRM_IOCTL_GEM_CLOSE, &args); 
+  free(bo);
+}
+
+
+///Reserves VA space for a freshly created buffer and maps it, frees the buffer on failure
+static int compute_bo_assign_va(struct gpu_buffer* buf, uint64_t alignment)
+{
+  buf->va = compute_pool_alloc(buf->ctx, buf->va_size, alignment, buf);
+  
+  if (compute_vm_map(buf->ctx, buf->va, buf->handle, 0, buf->vm_flags))
+  {
+    compute_pool_free(buf->ctx, buf->va);
+    buf->va = 0;
+    compute_free_gpu_buffer(buf);
+    return -1;
+  }
+  
+  return 0;
+}
+
+///Large buffers are placed and sized in whole fragments, so the VM can map them with fragment PTEs
+static uint64_t compute_va_fragment_size(uint64_t size)
+{
+  if (size >= COMPUTE_VA_LARGE_FRAGMENT_SIZE)
+  {
+    return COMPUTE_VA_LARGE_FRAGMENT_SIZE;
+  }
+  
+  if (size >= COMPUTE_VA_FRAGMENT_SIZE)
+  {
+    return COMPUTE_VA_FRAGMENT_SIZE;
+  }
+  
+  return 4096;
+}
+
+///Moves an idle buffer to a lower VA, va must not overlap any other pool entry
+static int compute_bo_relocate_va(struct pool_node* n, uint64_t va)
+{
+  struct gpu_buffer* bo = n->bo;
+  struct compute_context* ctx = bo->ctx;
+  
+  if (compute_vm_unmap(ctx, bo->va, bo->handle, 0))
+  {
+    return -1;
+  }
+  
+  if (compute_vm_map(ctx, va, bo->handle, 0, bo->vm_flags))
+  {
+    ///put it back so the buffer stays usable at its old address
+    if (compute_vm_map(ctx, bo->va, bo->handle, 0, bo->vm_flags))
+    {
+      fprintf(stderr, "radeon: buffer 0x%08X lost its VA mapping during compaction\n", bo->handle);
+    }
+    
+    return -1;
+  }
+  
+  n->va = va;
+  bo->va = va;
+  
+  return 0;
+}
+
+static int compute_bo_idle(struct gpu_buffer* bo)
+{
+  struct drm_radeon_gem_busy busy;
+  
+  memset(&busy, 0, sizeof(busy));
+  busy.handle = bo->handle;
+  
+  return drmCommandWriteRead(bo->ctx->fd, DRM_RADEON_GEM_BUSY, &busy, sizeof(busy)) == 0;
+}
+
+int compute_compact_va(struct compute_context* ctx)
+{
+  struct pool_node* n;
+  int moved = 0;
+  
+  for (n = ctx->vm_pool->next; n; n = n->next)
+  {
+    struct gpu_buffer* bo = n->bo;
+    uint64_t alignment = compute_va_fragment_size(n->size);
+    uint64_t va;
+    
+    if (alignment < bo->alignment)
+    {
+      alignment = bo->alignment;
+    }
+    
+    va = (n->prev->va + n->prev->size + alignment - 1) & ~(alignment - 1);
+    
+    if (va >= n->va || (bo->flags & (COMPUTE_BUFFER_INTERNAL | COMPUTE_BUFFER_PINNED)) || !compute_bo_idle(bo))
+    {
+      continue;
+    }
+    
+    if (compute_bo_relocate_va(n, va))
+    {
+      return -1;
+    }
+    
+    moved++;
+  }
+  
+  return moved;
+}
+
+void compute_get_va_stats(const struct compute_context* ctx, struct compute_va_stats* stats)
+{
+  const struct pool_node* n;
+  
+  memset(stats, 0, sizeof(struct compute_va_stats));
+  
+  for (n = ctx->vm_pool->next; n; n = n->next)
+  {
+    uint64_t hole = n->va - (n->prev->va + n->prev->size);
+    
+    if (hole)
+    {
+      stats->free += hole;
+      stats->holes++;
+      
+      if (hole > stats->largest_hole)
+      {
+        stats->largest_hole = hole;
+      }
+    }
+    
+    stats->used += n->size;
+    stats->buffers++;
+    stats->end = n->va + n->size;
+  }
+}
+
+static struct compute_heap* compute_heap_of(struct compute_context* ctx, int domain)
+{
+  switch (domain)
+  {
+    case RADEON_DOMAIN_VRAM: return &ctx->vram;
+    case RADEON_DOMAIN_GTT: return &ctx->gtt;
+    default: return NULL;
+  }
+}
+
+///Adds (sign = 1) or removes (sign = -1) the buffer from its domain's usage
+static void compute_account(struct gpu_buffer* bo, int sign)
+{
+  struct compute_heap* heap = compute_heap_of(bo->ctx, bo->domain);
+
+  if (!heap || (bo->flags & (COMPUTE_BUFFER_USERPTR | COMPUTE_BUFFER_IMPORTED)))
+  {
+    return;
+  }
+
+  if (sign > 0)
+  {
+    heap->used += bo->gem_size;
+    
+    if (heap->used > heap->peak)
+    {
+      heap->peak = heap->used;
+    }
+  }
+  else
+  {
+    heap->used -= bo->gem_size;
+  }
+  
+  if (bo->domain == RADEON_DOMAIN_VRAM && (bo->flags & COMPUTE_BUFFER_CPU_ACCESS))
+  {
+    bo->ctx->vram_visible_used += sign > 0 ? bo->gem_size : -bo->gem_size;
+  }
+}
+
+static void compute_touch(struct gpu_buffer* bo)
+{
+  bo->last_use = ++bo->ctx->use_clock;
+}
+
+///Submits an empty IB so the kernel validates every buffer into its current domain right away
+static int compute_apply_placement(struct compute_context* ctx)
+{
+  unsigned buf[16];
+  int cdw = 0;
+
+  buf[cdw++] = PKT3C(PKT3_NOP, 0, 0);
+  buf[cdw++] = 0;
+
+  return compute_submit(ctx, COMPUTE_RING_COMPUTE, 1, buf, cdw, NULL, COMPUTE_ALL_BUFFERS, NULL);
+}
+
+///Spills least recently used VRAM buffers to GTT until the context uses at most limit bytes of VRAM
+static int compute_spill_vram(struct compute_context* ctx, uint64_t limit)
+{
+  struct pool_node* n;
+  int spilled = 0;
+
+  while (ctx->vram.used > limit)
+  {
+    struct gpu_buffer* lru = NULL;
+
+    for (n = ctx->vm_pool->next; n; n = n->next)
+    {
+      struct gpu_buffer* bo = n->bo;
+
+      if (bo->domain != RADEON_DOMAIN_VRAM ||
+          (bo->flags & (COMPUTE_BUFFER_INTERNAL | COMPUTE_BUFFER_PINNED | COMPUTE_BUFFER_USERPTR | COMPUTE_BUFFER_IMPORTED)) ||
+          ctx->gtt.used + bo->gem_size > ctx->gtt.budget)
+      {
+        continue;
+      }
+
+      if (!lru || bo->last_use < lru->last_use)
+      {
+        lru = bo;
+      }
+    }
+
+    if (!lru)
+    {
+      break;
+    }
+
+    ///the kernel moves the buffer at the next submission, which requests it in GTT
+    compute_account(lru, -1);
+    lru->domain = RADEON_DOMAIN_GTT;
+    compute_account(lru, 1);
+    spilled = 1;
+  }
+
+  if (spilled)
+  {
+    compute_apply_placement(ctx);
+  }
+
+  return ctx->vram.used <= limit ? 0 : -1;
+}
+
+static int compute_gem_create(struct compute_context* ctx, struct drm_radeon_gem_create* args)
+{
+  return drmCommandWriteRead(ctx->fd, DRM_RADEON_GEM_CREATE, args, sizeof(*args));
+}
+
+struct gpu_buffer* compute_alloc_gpu_buffer(struct compute_context* ctx, uint64_t size, int domain, uint64_t alignment, uint32_t flags)
+{
+  struct drm_radeon_gem_create args;
+  struct gpu_buffer* buf;
+  uint64_t fragment;
+  uint64_t placement;
+  int r;
+  
+  if (size == 0)
+  {
+    return NULL;
+  }
+  
+  fragment = compute_va_fragment_size(size);
+  ///the hardware fragment is 64K, physical size and placement don't have to follow the larger VA alignment
+  placement = fragment > COMPUTE_VA_FRAGMENT_SIZE ? COMPUTE_VA_FRAGMENT_SIZE : fragment;
+  
+  memset(&args, 0, sizeof(args));
+  args.size = (size + placement - 1) & ~(placement - 1);
+  args.alignment = placement;
+  
+  if (args.alignment < alignment)
+  {
+    args.alignment = alignment;
+  }
+  
+  if (alignment < fragment)
+  {
+    alignment = fragment;
+  }
+  
+  if (domain == RADEON_DOMAIN_VRAM &&
+      (args.size > ctx->vram.budget || compute_spill_vram(ctx, ctx->vram.budget - args.size)))
+  {
+    ///over budget even after spilling cold buffers, degrade to GTT instead of failing
+    domain = RADEON_DOMAIN_GTT;
+  }
+  
+  if (domain == RADEON_DOMAIN_VRAM && (flags & COMPUTE_BUFFER_CPU_ACCESS) && ctx->vram_visible_size &&
+      ctx->vram_visible_used + args.size > ctx->vram_visible_size)
+  {
+    ///the CPU visible window is full, GTT is the next best place for a buffer the CPU keeps touching
+    domain = RADEON_DOMAIN_GTT;
+  }
+  
+  if (domain == RADEON_DOMAIN_VRAM)
+  {
+    args.flags = (flags & COMPUTE_BUFFER_CPU_ACCESS) ? RADEON_GEM_CPU_ACCESS : RADEON_GEM_NO_CPU_ACCESS;
+  }
+  
+  if (domain == RADEON_DOMAIN_GTT && ctx->gtt.used + args.size > ctx->gtt.budget)
+  {
+    fprintf(stderr, "radeon: GTT budget of %lu bytes exhausted\n", ctx->gtt.budget);
+    return NULL;
+  }
+  
+  args.initial_domain = domain;
+  r = compute_gem_create(ctx, &args);
+  
+  if (r && domain == RADEON_DOMAIN_VRAM)
+  {
+    ///the device is full, make room by spilling our own cold buffers, then fall back to GTT
+    if (ctx->vram.used >= args.size && compute_spill_vram(ctx, ctx->vram.used - args.size) == 0)
+    {
+      r = compute_gem_create(ctx, &args);
+    }
+  
+    if (r && ctx->gtt.used + args.size <= ctx->gtt.budget)
+    {
+      args.initial_domain = domain = RADEON_DOMAIN_GTT;
+      args.flags = 0;
+      r = compute_gem_create(ctx, &args);
+    }
+  }
+  
+  if (r)
+  {
+    fprintf(stderr, "radeon: Failed to allocate a buffer:\n");
+    fprintf(stderr, "radeon:    size      : %lu bytes\n", size);
+    fprintf(stderr, "radeon:    alignment : %lu bytes\n", alignment);
+    fprintf(stderr, "radeon:    domains   : %d\n", domain);
+    return NULL;
+  }
+  
+  buf = calloc(1, sizeof(struct gpu_buffer));
+  
+  buf->ctx = ctx;
+  buf->alignment = args.alignment;
+  buf->handle = args.handle;
+  buf->domain = domain;
+  buf->flags = flags;
+  buf->size = size;
+  
+  buf->va_size = (size + fragment - 1) & ~(fragment - 1);
+  buf->gem_size = args.size;
+  buf->vm_flags = RADEON_VM_PAGE_SNOOPED | RADEON_VM_PAGE_WRITEABLE;
+  
+  compute_account(buf, 1);
+  compute_touch(buf);
+  
+  if (compute_bo_assign_va(buf, alignment))
+  {
+    return NULL;
+  }
+  
+  compute_trace_alloc(buf);
+  
+  return buf;
+}
+
+int compute_get_memory_stats(struct compute_context* ctx, int domain, struct compute_memory_stats* stats)
+{
+  struct compute_heap* heap = compute_heap_of(ctx, domain);
+  struct drm_radeon_info ginfo;
+  uint64_t device_used = 0;
+
+  if (!heap)
+  {
+    return -1;
+  }
+
+  memset(&ginfo, 0, sizeof(ginfo));
+  ginfo.request = domain == RADEON_DOMAIN_VRAM ? RADEON_INFO_VRAM_USAGE : RADEON_INFO_GTT_USAGE;
+  ginfo.value = (uintptr_t)&device_used;
+
+  if (drmCommandWriteRead(ctx->fd, DRM_RADEON_INFO, &ginfo, sizeof(ginfo)))
+  {
+    device_used = 0;
+  }
+
+  stats->size = heap->size;
+  stats->device_used = device_used;
+  stats->used = heap->used;
+  stats->budget = heap->budget;
+  stats->visible_size = domain == RADEON_DOMAIN_VRAM ? ctx->vram_visible_size : 0;
+  stats->visible_used = domain == RADEON_DOMAIN_VRAM ? ctx->vram_visible_used : 0;
+
+  return 0;
+}
+
+void compute_set_memory_budget(struct compute_context* ctx, int domain, uint64_t budget)
+{
+  struct compute_heap* heap = compute_heap_of(ctx, domain);
+
+  if (!heap)
+  {
+    return;
+  }
+
+  heap->budget = budget;
+
+  if (domain == RADEON_DOMAIN_VRAM)
+  {
+    compute_spill_vram(ctx, budget);
+  }
+}
+
+struct gpu_buffer* compute_import_host_buffer(struct compute_context* ctx, void* ptr, uint64_t size, int read_only)
+{
+  struct drm_radeon_gem_userptr args;
+  struct gpu_buffer* buf;
+  long page_size = sysconf(_SC_PAGESIZE);
+  
+  if (size == 0 || ((uintptr_t)ptr & (page_size - 1)) || (size & (page_size - 1)))
+  {
+    fprintf(stderr, "radeon: host buffer %p+0x%lx is not page aligned\n", ptr, size);
+    return NULL;
+  }
+  
+  memset(&args, 0, sizeof(args));
+  args.addr = (uintptr_t)ptr;
+  args.size = size;
+  args.flags = RADEON_GEM_USERPTR_VALIDATE;
+  
+  if (read_only)
+  {
+    args.flags |= RADEON_GEM_USERPTR_READONLY;
+  }
+  else
+  {
+    ///the kernel only allows writable userptrs on anonymous memory with an MMU notifier
+    args.flags |= RADEON_GEM_USERPTR_ANONONLY | RADEON_GEM_USERPTR_REGISTER;
+  }
+  
+  if (drmCommandWriteRead(ctx->fd, DRM_RADEON_GEM_USERPTR, &args, sizeof(args)))
+  {
+    fprintf(stderr, "radeon: Failed to import host buffer %p+0x%lx: %s\n", ptr, size, strerror(errno));
+    return NULL;
+  }
+  
+  buf = calloc(1, sizeof(struct gpu_buffer));
+  
+  buf->ctx = ctx;
+  buf->alignment = page_size;
+  buf->handle = args.handle;
+  buf->domain = RADEON_DOMAIN_GTT;
+  buf->flags = COMPUTE_BUFFER_USERPTR;
+  buf->size = size;
+  buf->cpu_ptr = ptr;
+  
+  buf->va_size = size;
+  buf->gem_size = size;
+  buf->vm_flags = RADEON_VM_PAGE_SYSTEM | RADEON_VM_PAGE_SNOOPED;
+  
+  ///GPU writes to read-only pages would land in memory the kernel believes unchanged
+  if (!read_only)
+  {
+    buf->vm_flags |= RADEON_VM_PAGE_WRITEABLE;
+  }
+  
+  if (compute_bo_assign_va(buf, 4096))
+  {
+    return NULL;
+  }
+  
+  compute_trace_alloc(buf);
+  
+  return buf;
+}
+
+int compute_export_gpu_buffer(struct gpu_buffer* bo, int* dmabuf_fd)
+{
+  if (drmPrimeHandleToFD(bo->ctx->fd, bo->handle, DRM_CLOEXEC | DRM_RDWR, dmabuf_fd))
+  {
+    fprintf(stderr, "radeon: Failed to export buffer 0x%08X: %s\n", bo->handle, strerror(errno));
+    return -1;
+  }
+  
+  return 0;
+}
+
+struct gpu_buffer* compute_import_gpu_buffer(struct compute_context* ctx, int dmabuf_fd)
+{
+  struct drm_radeon_gem_busy busy;
+  struct gpu_buffer* buf;
+  struct pool_node* n;
+  uint32_t handle;
+  off_t size;
+  uint64_t fragment;
+  
+  size = lseek(dmabuf_fd, 0, SEEK_END);
+  
+  if (size <= 0)
+  {
+    fprintf(stderr, "radeon: Could not query the size of dma-buf %i\n", dmabuf_fd);
+    return NULL;
+  }
+  
+  lseek(dmabuf_fd, 0, SEEK_SET);
+  
+  if (drmPrimeFDToHandle(ctx->fd, dmabuf_fd, &handle))
+  {
+    fprintf(stderr, "radeon: Failed to import dma-buf %i: %s\n", dmabuf_fd, strerror(errno));
+    return NULL;
+  }
+  
+  ///a buffer exported from this context comes back with its original handle
+  for (n = ctx->vm_pool->next; n; n = n->next)
+  {
+    if (n->bo->handle == handle)
+    {
+      fprintf(stderr, "radeon: dma-buf %i is already present in this context as %p\n", dmabuf_fd, n->bo);
+      return NULL;
+    }
+  }
+  
+  memset(&busy, 0, sizeof(busy));
+  busy.handle = handle;
+  
+  ///GEM_BUSY reports the current placement even while the buffer is busy
+  if (drmCommandWriteRead(ctx->fd, DRM_RADEON_GEM_BUSY, &busy, sizeof(busy)) && errno != EBUSY)
+  {
+    busy.domain = RADEON_DOMAIN_GTT;
+  }
+  
+  fragment = compute_va_fragment_size(size);
+  
+  buf = calloc(1, sizeof(struct gpu_buffer));
+  
+  buf->ctx = ctx;
+  buf->alignment = 4096;
+  buf->handle = handle;
+  buf->domain = busy.domain ? busy.domain : RADEON_DOMAIN_GTT;
+  buf->flags = COMPUTE_BUFFER_IMPORTED;
+  buf->size = size;
+  
+  buf->va_size = (size + 4095) & ~(uint64_t)4095;
+  buf->gem_size = buf->va_size;
+  buf->vm_flags = RADEON_VM_PAGE_SNOOPED | RADEON_VM_PAGE_WRITEABLE;
+  
+  if (compute_bo_assign_va(buf, fragment))
+  {
+    return NULL;
+  }
+  
+  compute_trace_alloc(buf);
+  
+  return buf;
+}
+
+int compute_buffer_view_init(struct gpu_buffer_view* view, struct gpu_buffer* bo, uint64_t offset, uint64_t size, unsigned stride, int num_format, int data_format)
+{
+  uint64_t num_records;
+  
+  memset(view, 0, sizeof(struct gpu_buffer_view));
+  
+  if (offset > bo->size || size > bo->size - offset)
+  {
+    fprintf(stderr, "radeon: buffer view 0x%lx+0x%lx exceeds buffer size 0x%lx\n", offset, size, bo->size);
+    return -1;
+  }
+  
+  if (stride > 0x3FFF)
+  {
+    fprintf(stderr, "radeon: buffer view stride %u too large\n", stride);
+    return -1;
+  }
+  
+  num_records = stride ? size / stride : size;
+  
+  if (num_records > 0xFFFFFFFFull)
+  {
+    fprintf(stderr, "radeon: buffer view has too many records: 0x%lx\n", num_records);
+    return -1;
+  }
+  
+  view->bo = bo;
+  view->offset = offset;
+  view->size = size;
+  view->stride = stride;
+  view->num_format = num_format;
+  view->data_format = data_format;
+  
+  return 0;
+}
+
+const uint32_t* compute_buffer_view_descriptor(struct gpu_buffer_view* view)
+{
+  uint64_t va = view->bo->va + view->offset;
+  
+  compute_touch(view->bo);
+  
+  if (view->descriptor_va == va)
+  {
+    return view->descriptor;
+  }
+  
+  view->descriptor[0] = va;
+  view->descriptor[1] = S_008F04_BASE_ADDRESS_HI(va >> 32) |
+                        S_008F04_STRIDE(view->stride);
+  view->descriptor[2] = view->stride ? view->size / view->stride : view->size;
+  view->descriptor[3] = S_008F0C_DST_SEL_X(V_008F0C_SQ_SEL_X) |
+                        S_008F0C_DST_SEL_Y(V_008F0C_SQ_SEL_Y) |
+                        S_008F0C_DST_SEL_Z(V_008F0C_SQ_SEL_Z) |
+                        S_008F0C_DST_SEL_W(V_008F0C_SQ_SEL_W) |
+                        S_008F0C_NUM_FORMAT(view->num_format) |
+                        S_008F0C_DATA_FORMAT(view->data_format) |
+                        S_008F0C_ELEMENT_SIZE(1);
+  
+  view->descriptor_va = va;
+  
+  return view->descriptor;
+}
+
+struct compute_arena* compute_create_arena(struct compute_context* ctx, uint64_t size)
+{
+  struct compute_arena* arena = calloc(1, sizeof(struct compute_arena));
+  
+  arena->bo = compute_alloc_gpu_buffer(ctx, size, RADEON_DOMAIN_GTT, 4096, COMPUTE_BUFFER_INTERNAL);
+  
+  if (!arena->bo)
+  {
+    free(arena);
+    return NULL;
+  }
+  
+  arena->cpu_ptr = compute_map_gpu_buffer(arena->bo);
+  
+  if (!arena->cpu_ptr)
+  {
+    compute_free_gpu_buffer(arena->bo);
+    free(arena);
+    return NULL;
+  }
+  
+  arena->size = size;
+  arena->head = 0;
+  arena->tail = 0;
+  arena->mark_first = 0;
+  arena->mark_count = 0;
+  
+  return arena;
+}
+
+void compute_free_arena(struct compute_arena* arena)
+{
+  compute_unmap_gpu_buffer(arena->bo);
+  compute_free_gpu_buffer(arena->bo);
+  free(arena);
+}
+
+///Releases the space of every submission that already retired
+static void compute_arena_reclaim(struct compute_arena* arena)
+{
+  while (arena->mark_count)
+  {
+    struct compute_arena_mark* m = &arena->marks[arena->mark_first];
+    
+    if (!compute_fence_signaled(arena->bo->ctx, &m->fence))
+    {
+      break;
+    }
+    
+    arena->tail = m->pos;
+    arena->mark_first = (arena->mark_first + 1) % COMPUTE_ARENA_MAX_MARKS;
+    arena->mark_count--;
+  }
+}
+
+///Everything allocated up to now is released once the fence signals
+static void compute_arena_mark(struct compute_arena* arena, const struct compute_fence* fence)
+{
+  struct compute_arena_mark* m;
+  
+  if (arena->mark_count)
+  {
+    m = &arena->marks[(arena->mark_first + arena->mark_count - 1) % COMPUTE_ARENA_MAX_MARKS];
+    
+    if (m->pos == arena->head)
+    {
+      return;
+    }
+  }
+  else if (arena->tail == arena->head)
+  {
+    return;
+  }
+  
+  if (arena->mark_count == COMPUTE_ARENA_MAX_MARKS)
+  {
+    compute_fence_wait(arena->bo->ctx, &arena->marks[arena->mark_first].fence);
+    compute_arena_reclaim(arena);
+  }
+  
+  m = &arena->marks[(arena->mark_first + arena->mark_count) % COMPUTE_ARENA_MAX_MARKS];
+  m->fence = *fence;
+  m->pos = arena->head;
+  arena->mark_count++;
+}
+
+void* compute_arena_alloc(struct compute_arena* arena, uint64_t size, uint64_t alignment, uint64_t* va)
+{
+  uint64_t pos, offset;
+  
+  assert((alignment & (alignment - 1)) == 0 && arena->size % alignment == 0);
+  
+  if (size > arena->size)
+  {
+    return NULL;
+  }
+  
+  pos = (arena->head + alignment - 1) & ~(alignment - 1);
+  offset = pos % arena->size;
+  
+  if (offset + size > arena->size)
+  {
+    ///allocations never wrap around the end of the ring
+    pos += arena->size - offset;
+    offset = 0;
+  }
+  
+  compute_arena_reclaim(arena);
+  
+  while (pos + size - arena->tail > arena->size)
+  {
+    if (arena->mark_count == 0)
+    {
+      ///the space is taken by allocations that were not submitted yet
+      return NULL;
+    }
+    
+    compute_fence_wait(arena->bo->ctx, &arena->marks[arena->mark_first].fence);
+    compute_arena_reclaim(arena);
+  }
+  
+  arena->head = pos + size;
+  *va = arena->bo->va + offset;
+  
+  return arena->cpu_ptr + offset;
+}
+
+void* compute_alloc_transient(struct compute_context* ctx, uint64_t size, uint64_t alignment, uint64_t* va)
+{
+  if (!ctx->arena)
+  {
+    ctx->arena = compute_create_arena(ctx, COMPUTE_ARENA_SIZE);
+    
+    if (!ctx->arena)
+    {
+      return NULL;
+    }
+  }
+  
+  return compute_arena_alloc(ctx->arena, size, alignment, va);
+}
+
+uint64_t compute_upload_transient(struct compute_context* ctx, const void* data, uint64_t size, uint64_t alignment)
+{
+  void* ptr;
+  uint64_t va;
+  
+  ptr = compute_alloc_transient(ctx, size, alignment, &va);
+  
+  if (!ptr)
+  {
+    fprintf(stderr, "radeon: transient upload of %lu bytes does not fit the arena\n", size);
+    return 0;
+  }
+  
+  memcpy(ptr, data, size);
+  
+  return va;
+}
+
+uint64_t compute_upload_arguments(struct compute_context* ctx, const void* data, uint64_t size)
+{
+  return compute_upload_transient(ctx, data, size, COMPUTE_ARG_ALIGNMENT);
+}
+
+int compute_bo_wait(struct gpu_buffer *boi)
+{
+    struct drm_radeon_gem_wait_idle args;
+    int ret;
+    
+    /* Zero out args to make valgrind happy */
+    memset(&args, 0, sizeof(args));
+    args.handle = boi->handle;
+    do {
+        ret = drmCommandWriteRead(boi->ctx->fd, DRM_RADEON_GEM_WAIT_IDLE,
+                                  &args, sizeof(args));
+    } while (ret == -EBUSY);
+    return ret;
+}
+
+int compute_fence_signaled(const struct compute_context* ctx, const struct compute_fence* fence)
+{
+  const struct compute_ring_state* ring = &ctx->rings[fence->ring];
+  
+  return (int32_t)(*ring->fence_ptr - fence->seq) >= 0;
+}
+
+int compute_fence_wait(const struct compute_context* ctx, const struct compute_fence* fence)
+{
+  const struct compute_ring_state* ring = &ctx->rings[fence->ring];
+  uint64_t start;
+  int r;
+  
+  if (compute_fence_signaled(ctx, fence))
+  {
+    return 0;
+  }
+  
+  ///blocking waits for the ring to drain, which would stall pipelined transfers waiting on their oldest chunk.
+  ///Longer waits are worth the stall rather than burning a core.
+  start = compute_time_ns();
+  
+  while (compute_time_ns() - start < COMPUTE_FENCE_SPIN_NS)
+  {
+    if (compute_fence_signaled(ctx, fence))
+    {
+      return 0;
+    }
+    
+    sched_yield();
+  }
+  
+  while (!compute_fence_signaled(ctx, fence))
+  {
+    ///every submission on the ring writes its fence buffer, so this blocks until the ring drained
+    r = compute_bo_wait(ring->fence_bo);
+    
+    if (r)
+    {
+      return r;
+    }
+  }
+  
+  return 0;
+}
+
+int compute_set_dependencies(struct compute_context* ctx, const struct compute_fence* fences, int count)
+{
+  int i;
+  
+  memset(ctx->dep_seq, 0, sizeof(ctx->dep_seq));
+  
+  for (i = 0; i < count; i++)
+  {
+    if (fences[i].ring >= COMPUTE_RING_COUNT)
+    {
+      return -1;
+    }
+    
+    ///a ring retires in order, so its newest fence covers the older ones
+    if (fences[i].seq && (int32_t)(fences[i].seq - ctx->dep_seq[fences[i].ring]) > 0)
+    {
+      ctx->dep_seq[fences[i].ring] = fences[i].seq;
+    }
+  }
+  
+  return 0;
+}
+
+static int compute_dependency_pending(const struct compute_context* ctx, int ring)
+{
+  struct compute_fence fence = {ring, ctx->dep_seq[ring]};
+  
+  return fence.seq && !compute_fence_signaled(ctx, &fence);
+}
+
+///Returns buf with a WAIT_REG_MEM on every unfinished dependency put in front, or buf itself without any.
+///The waiting fence was written at the end of pipe, so the dependency's results are already in memory.
+static unsigned* compute_emit_dependencies(const struct compute_context* ctx, unsigned* buf, int* cdw)
+{
+  unsigned* waits = NULL;
+  int n = 0;
+  int i;
+  
+  for (i = 0; i < COMPUTE_RING_COUNT; i++)
+  {
+    uint64_t va = ctx->rings[i].fence_bo->va;
+    
+    if (!compute_dependency_pending(ctx, i))
+    {
+      continue;
+    }
+    
+    if (!waits)
+    {
+      waits = malloc(sizeof(unsigned)*(7*COMPUTE_RING_COUNT + *cdw + COMPUTE_FENCE_DW));
+    }
+    
+    waits[n++] = PKT3C(PKT3_WAIT_REG_MEM, 5, 0);
+    waits[n++] = WAIT_REG_MEM_GEQUAL | WAIT_REG_MEM_MEM_SPACE(1);
+    waits[n++] = va;
+    waits[n++] = (va >> 32) & 0xFF;
+    waits[n++] = ctx->dep_seq[i];
+    waits[n++] = 0xffffffff;
+    waits[n++] = 4; ///poll interval
+  }
+  
+  if (!waits)
+  {
+    return buf;
+  }
+  
+  memcpy(waits + n, buf, sizeof(unsigned)*(*cdw));
+  *cdw += n;
+  
+  return waits;
+}
+
+///Waits until no submitted work can access the buffer any more
+static int compute_bo_sync_cpu(struct gpu_buffer* bo)
+{
+  struct compute_context* ctx = bo->ctx;
+  struct compute_fence fence;
+  int i;
+  
+  for (i = 0; i < COMPUTE_RING_COUNT; i++)
+  {
+    fence.ring = i;
+    fence.seq = ctx->rings[i].last_seq;
+    
+    if (!compute_fence_signaled(ctx, &fence))
+    {
+      return compute_bo_wait(bo);
+    }
+  }
+  
+  return 0;
+}
+
+///Appends the fence write to buf, which must have COMPUTE_FENCE_DW dwords left, and submits it.
+///cs_id is the caller's submission id, dispatches pass compute_state::id and internal work 1.
+static int compute_submit(struct compute_context* ctx, int ring, int cs_id, unsigned* buf, int cdw, struct gpu_buffer* const* bos, int num_bos, struct compute_fence* fence)
+{
+  struct compute_ring_state* rs = &ctx->rings[ring];
+  struct drm_radeon_cs cs;
+  uint64_t chunk_array[5];
+  struct drm_radeon_cs_chunk chunks[5];
+  uint32_t flags[3];
+  struct cs_reloc_gem* relocs;
+  struct compute_fence f;
+  uint64_t fence_va = rs->fence_bo->va;
+  uint32_t seq = rs->last_seq + 1;
+  unsigned* ib = buf;
+  int r;
+  
+  ///the DMA ring runs in order and is never handed unfinished compute dependencies, see compute_dma_regions
+  if (ring == COMPUTE_RING_COMPUTE)
+  {
+    buf = compute_emit_dependencies(ctx, buf, &cdw);
+  }
+  
+  if (ring == COMPUTE_RING_DMA)
+  {
+    ///the DMA engine executes in order, so a plain write after the copies signals them
+    buf[cdw++] = DMA_PACKET(DMA_PACKET_WRITE, 0, 0, 0, 1);
+    buf[cdw++] = fence_va & 0xFFFFFFFC;
+    buf[cdw++] = (fence_va >> 32) & 0xFF;
+    buf[cdw++] = seq;
+    
+    while (cdw & 7)
+    {
+      buf[cdw++] = DMA_PACKET(DMA_PACKET_NOP, 0, 0, 0, 0);
+    }
+  }
+  else
+  {
+    buf[cdw++] = PKT3C(PKT3_EVENT_WRITE_EOP, 4, 0);
+    buf[cdw++] = EVENT_TYPE(EVENT_TYPE_CACHE_FLUSH_AND_INV_TS_EVENT) | EVENT_INDEX(5);
+    buf[cdw++] = fence_va;
+    buf[cdw++] = ((fence_va >> 32) & 0xFF) | EOP_DATA_SEL(1) | EOP_INT_SEL(0);
+    buf[cdw++] = seq;
+    buf[cdw++] = 0;
+  }
+  
+  flags[0] = RADEON_CS_USE_VM;
+  flags[1] = compute_radeon_ring[ring];
+  
+  chunks[0].chunk_id = RADEON_CHUNK_ID_FLAGS;
+  chunks[0].length_dw = 2;
+  chunks[0].chunk_data =  (uint64_t)(uintptr_t)&flags[0];
+
+  #define RELOC_SIZE (sizeof(struct cs_reloc_gem) / sizeof(uint32_t))
+  
+  int reloc_num = 0;
+  relocs = compute_create_reloc_table(ctx, ring, bos, num_bos, &reloc_num);
+  
+  chunks[1].chunk_id = RADEON_CHUNK_ID_RELOCS;
+  chunks[1].length_dw = reloc_num*RELOC_SIZE;
+  chunks[1].chunk_data =  (uint64_t)(uintptr_t)relocs;
+
+  chunks[2].chunk_id = RADEON_CHUNK_ID_IB;
+  chunks[2].length_dw = cdw;
+  chunks[2].chunk_data =  (uint64_t)(uintptr_t)&buf[0];  
+
+  chunk_array[0] = (uint64_t)(uintptr_t)&chunks[0];
+  chunk_array[1] = (uint64_t)(uintptr_t)&chunks[1];
+  chunk_array[2] = (uint64_t)(uintptr_t)&chunks[2];
+  
+  cs.num_chunks = 3;
+  cs.chunks = (uint64_t)(uintptr_t)chunk_array;
+  cs.cs_id = cs_id;
+  
+  r = drmCommandWriteRead(ctx->fd, DRM_RADEON_CS, &cs, sizeof(struct drm_radeon_cs));
+  
+  free(relocs);
+  
+  if (buf != ib)
+  {
+    free(buf);
+  }
+  
+  if (r)
+  {
+    return r;
+  }
+  
+  rs->last_seq = seq;
+  
+  f.ring = ring;
+  f.seq = seq;
+  
+  if (ring == COMPUTE_RING_COMPUTE && ctx->arena)
+  {
+    compute_arena_mark(ctx->arena, &f);
+  }
+  
+  if (fence)
+  {
+    *fence = f;
+  }
+  
+  return 0;
+}
+
+void compute_flush_caches(struct compute_context* ctx)
+{
+  unsigned buf[1024];
+  int cdw = 0;
+
+  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
+  buf[cdw++] = S_0085F0_TCL1_ACTION_ENA(1) |
+               S_0085F0_SH_ICACHE_ACTION_ENA(1) |
+               S_0085F0_SH_KCACHE_ACTION_ENA(1) |
+               S_0085F0_TC_ACTION_ENA(1);
+
+  buf[cdw++] = 0xffffffff;
+  buf[cdw++] = 0;
+  buf[cdw++] = 0xA;
+
+  printf("cdw: %i\n", cdw);
+
+  ///cache actions don't touch buffers, so this doesn't order anything with the DMA ring
+  int r = compute_submit(ctx, COMPUTE_RING_COMPUTE, 1, buf, cdw, NULL, 0, NULL);
+
+  printf("ret:%i\n", r);
+}
+
+int compute_emit_compute_state(struct compute_context* ctx, const struct compute_state* state, struct compute_fence* fence)
+{
+  int i;
+  unsigned buf[1024];
+  int cdw = 0;
+  
+  compute_touch(state->binary);
+  
+  set_compute_reg(R_00B804_COMPUTE_DIM_X,         state->dim[0]);
+  set_compute_reg(R_00B808_COMPUTE_DIM_Y,         state->dim[1]);
+  set_compute_reg(R_00B80C_COMPUTE_DIM_Z,         state->dim[2]);
+  set_compute_reg(R_00B810_COMPUTE_START_X,       state->start[0]);
+  set_compute_reg(R_00B814_COMPUTE_START_Y,       state->start[1]);
+  set_compute_reg(R_00B818_COMPUTE_START_Z,       state->start[2]);
+  
+  set_compute_reg(R_00B81C_COMPUTE_NUM_THREAD_X,  S_00B81C_NUM_THREAD_FULL(state->num_thread[0]));
+  set_compute_reg(R_00B820_COMPUTE_NUM_THREAD_Y,  S_00B820_NUM_THREAD_FULL(state->num_thread[1]));
+  set_compute_reg(R_00B824_COMPUTE_NUM_THREAD_Z,  S_00B824_NUM_THREAD_FULL(state->num_thread[2]));
+  
+  set_compute_reg(R_00B82C_COMPUTE_MAX_WAVE_ID,   S_00B82C_MAX_WAVE_ID(0x200));
+  
+  set_compute_reg(R_00B830_COMPUTE_PGM_LO,        (state->binary->va + state->code_offset) >> 8);
+  set_compute_reg(R_00B834_COMPUTE_PGM_HI,        (state->binary->va + state->code_offset) >> 40);
+  
+  set_compute_reg(R_00B848_COMPUTE_PGM_RSRC1,
+    S_00B848_VGPRS(state->vgpr_num) |  S_00B848_SGPRS(state->sgpr_num) |  S_00B848_PRIORITY(state->priority) |
+    S_00B848_FLOAT_MODE(0) | S_00B848_PRIV(0) | S_00B848_DX10_CLAMP(0) |
+    S_00B848_DEBUG_MODE(state->debug_mode) | S_00B848_IEEE_MODE(state->ieee_mode)
+  );
+  
+  set_compute_reg(R_00B84C_COMPUTE_PGM_RSRC2,
+    S_00B84C_SCRATCH_EN(state->scratch_en) | S_00B84C_USER_SGPR(state->user_data_length) |
+    S_00B84C_TGID_X_EN(1) | S_00B84C_TGID_Y_EN(1) | S_00B84C_TGID_Z_EN(1) |
+    S_00B84C_TG_SIZE_EN(1) |
+    S_00B84C_TIDIG_COMP_CNT(0) |
+    S_00B84C_LDS_SIZE(state->lds_size) |
+    S_00B84C_EXCP_EN(state->excp_en)
+  );
+  
+  set_compute_reg(R_00B854_COMPUTE_RESOURCE_LIMITS,
+    S_00B854_WAVES_PER_SH(state->waves_per_sh) | S_00B854_TG_PER_CU(state->thread_groups_per_cu) |
+    S_00B854_LOCK_THRESHOLD(state->lock_threshold) | S_00B854_SIMD_DEST_CNTL(state->simd_dest_cntl) 
+  );
+  
+  set_compute_reg(R_00B858_COMPUTE_STATIC_THREAD_MGMT_SE0,
+    S_00B858_SH0_CU_EN(state->se0_sh0_cu_en) | S_00B858_SH1_CU_EN(state->se0_sh1_cu_en)
+  );
+  
+  set_compute_reg(R_00B85C_COMPUTE_STATIC_THREAD_MGMT_SE1,
+    S_00B85C_SH0_CU_EN(state->se1_sh0_cu_en) | S_00B85C_SH1_CU_EN(state->se1_sh1_cu_en)
+  );
+  
+  
+  if (state->user_data_length)
+  {
+    buf[cdw++] = PKT3C(PKT3_SET_SH_REG, state->user_data_length, 0);
+    buf[cdw++] = (R_00B900_COMPUTE_USER_DATA_0 - SI_SH_REG_OFFSET) >> 2;
+
+    for (i = 0; i < state->user_data_length; i++)
+    {
+      buf[cdw++] = state->user_data[i];
+    }
+  }
+
+
+  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
+  buf[cdw++] = S_0085F0_TCL1_ACTION_ENA(1) |
+               S_0085F0_SH_ICACHE_ACTION_ENA(1) |
+               S_0085F0_SH_KCACHE_ACTION_ENA(1) |
+               S_0085F0_TC_ACTION_ENA(1);
+
+  buf[cdw++] = 0xffffffff;
+  buf[cdw++] = 0;
+  buf[cdw++] = 0xA;
+
+  set_compute_reg(R_00B800_COMPUTE_DISPATCH_INITIATOR,
+    S_00B800_COMPUTE_SHADER_EN(1) | S_00B800_PARTIAL_TG_EN(0) |
+    S_00B800_FORCE_START_AT_000(0) | S_00B800_ORDERED_APPEND_ENBL(0) 
+  );
+  
+  set_compute_reg(R_00B800_COMPUTE_DISPATCH_INITIATOR, 0);
+
+  if (!state->buffers)
+  {
+    ///code heaps are internal, so they aren't among all buffers
+    return compute_submit(ctx, COMPUTE_RING_COMPUTE, state->id, buf, cdw, &state->binary, COMPUTE_ALL_BUFFERS, fence);
+  }
+  
+  struct gpu_buffer** bos = malloc(sizeof(struct gpu_buffer*)*(state->num_buffers + 1));
+  int r;
+  
+  bos[0] = state->binary;
+  
+  for (i = 0; i < state->num_buffers; i++)
+  {
+    compute_touch(state->buffers[i]);
+    bos[i + 1] = state->buffers[i];
+  }
+  
+  r = compute_submit(ctx, COMPUTE_RING_COMPUTE, state->id, buf, cdw, bos, state->num_buffers + 1, fence);
+  
+  free(bos);
+  
+  return r;
+}
+
+static int compute_kernel_info_valid(const struct compute_kernel_info* info)
+{
+  uint32_t threads = 1;
+  int i;
+  
+  for (i = 0; i < 3; i++)
+  {
+    threads *= info->local_size[i] ? info->local_size[i] : 1;
+  }
+  
+  if (info->scratch_size)
+  {
+    fprintf(stderr, "radeon: kernels using scratch are not supported\n");
+    return 0;
+  }
+  
+  return info->vgprs <= 256 && info->sgprs <= 104 && info->lds_size <= 32*1024 &&
+         info->user_sgprs <= 16 && threads <= 1024;
+}
+
+///First fit in offset order, returns the kernel to insert before through next (NULL appends) or -1 if the heap is full
+static int compute_code_heap_fit(const struct compute_code_heap* heap, uint64_t size, uint64_t* offset, struct compute_kernel** next)
+{
+  struct compute_kernel* k;
+  uint64_t pos = 0;
+  
+  for (k = heap->kernels; k; k = k->next)
+  {
+    if (k->offset - pos >= size)
+    {
+      break;
+    }
+    
+    pos = (k->offset + k->size + COMPUTE_CODE_ALIGNMENT - 1) & ~(uint64_t)(COMPUTE_CODE_ALIGNMENT - 1);
+  }
+  
+  if (!k && heap->bo->size - pos < size)
+  {
+    return -1;
+  }
+  
+  *offset = pos;
+  *next = k;
+  
+  return 0;
+}
+
+struct compute_kernel* compute_create_kernel(struct compute_context* ctx, const void* code, uint64_t size, const struct compute_kernel_info* info)
+{
+  struct compute_code_heap* heap;
+  struct compute_kernel* next = NULL;
+  struct compute_kernel* kernel;
+  uint64_t offset = 0;
+  int created = 0;
+  
+  if (size == 0 || !compute_kernel_info_valid(info))
+  {
+    return NULL;
+  }
+  
+  for (heap = ctx->code_heaps; heap; heap = heap->next)
+  {
+    if (compute_code_heap_fit(heap, size, &offset, &next) == 0)
+    {
+      break;
+    }
+  }
+  
+  if (!heap)
+  {
+    uint64_t heap_size = size > COMPUTE_CODE_HEAP_SIZE ? size : COMPUTE_CODE_HEAP_SIZE;
+    
+    heap = calloc(1, sizeof(struct compute_code_heap));
+    heap->bo = compute_alloc_gpu_buffer(ctx, heap_size, RADEON_DOMAIN_VRAM, COMPUTE_CODE_ALIGNMENT,
+                                        COMPUTE_BUFFER_INTERNAL | COMPUTE_BUFFER_PINNED);
+    
+    if (!heap->bo)
+    {
+      free(heap);
+      return NULL;
+    }
+    
+    heap->next = ctx->code_heaps;
+    ctx->code_heaps = heap;
+    offset = 0;
+    next = NULL;
+    created = 1;
+  }
+  
+  ///launches of other kernels in the heap are ordered before the upload by the kernel
+  if (compute_copy_to_gpu(heap->bo, offset, code, size))
+  {
+    if (created)
+    {
+      ctx->code_heaps = heap->next;
+      compute_free_gpu_buffer(heap->bo);
+      free(heap);
+    }
+    
+    return NULL;
+  }
+  
+  kernel = calloc(1, sizeof(struct compute_kernel));
+  kernel->heap = heap;
+  kernel->offset = offset;
+  kernel->size = size;
+  kernel->va = heap->bo->va + offset;
+  kernel->info = *info;
+  
+  if (next)
+  {
+    kernel->prev = next->prev;
+    kernel->next = next;
+    next->prev = kernel;
+  }
+  else
+  {
+    kernel->prev = heap->kernels;
+    
+    while (kernel->prev && kernel->prev->next)
+    {
+      kernel->prev = kernel->prev->next;
+    }
+  }
+  
+  if (kernel->prev)
+  {
+    kernel->prev->next = kernel;
+  }
+  else
+  {
+    heap->kernels = kernel;
+  }
+  
+  return kernel;
+}
+
+void compute_free_kernel(struct compute_kernel* kernel)
+{
+  ///launches still running the code keep the heap busy, so the next upload into the range waits for them
+  if (kernel->prev)
+  {
+    kernel->prev->next = kernel->next;
+  }
+  else
+  {
+    kernel->heap->kernels = kernel->next;
+  }
+  
+  if (kernel->next)
+  {
+    kernel->next->prev = kernel->prev;
+  }
+  
+  free(kernel);
+}
+
+int compute_kernel_setup_state(const struct compute_kernel* kernel, struct compute_state* state)
+{
+  const struct compute_kernel_info* info = &kernel->info;
+  int i;
+  
+  for (i = 0; i < 3; i++)
+  {
+    if (info->local_size[i] && (uint32_t)state->num_thread[i] != info->local_size[i])
+    {
+      return -1;
+    }
+  }
+  
+  if ((uint32_t)state->user_data_length > info->user_sgprs)
+  {
+    return -1;
+  }
+  
+  for (i = state->user_data_length; i < (int)info->user_sgprs; i++)
+  {
+    state->user_data[i] = 0;
+  }
+  
+  state->user_data_length = info->user_sgprs;
+  state->binary = kernel->heap->bo;
+  state->code_offset = kernel->offset;
+  
+  ///granularity of 4 VGPRs and 8 SGPRs, LDS in 256 byte blocks
+  state->vgpr_num = info->vgprs ? (info->vgprs - 1) / 4 : 0;
+  state->sgpr_num = info->sgprs ? (info->sgprs - 1) / 8 : 0;
+  state->lds_size = (info->lds_size + 255) / 256;
+  state->scratch_en = 0;
+  state->tmpring_waves = 0;
+  state->tmpring_wavesize = 0;
+  
+  ///no limits, the SPI fits as many waves as the registers and LDS allow
+  state->waves_per_sh = 0;
+  state->thread_groups_per_cu = 0;
+  
+  return 0;
+}
+
+static int compute_bo_cpu_map(struct gpu_buffer* bo)
+{
+  struct drm_radeon_gem_mmap args;
+  int r;
+  void* ptr;
+  
+  if (bo->cpu_ptr)
+  {
+    return 0;
+  }
+  
+  memset(&args, 0, sizeof(args));
+  
+  args.handle = bo->handle;
+  args.offset = 0;
+  args.size = bo->size;
+  r = drmCommandWriteRead(bo->ctx->fd,
+                          DRM_RADEON_GEM_MMAP,
+                          &args,
+                          sizeof(args));
+  if (r)
+  {
+    fprintf(stderr, "error mapping %p 0x%08X (error = %d)\n", bo, bo->handle, r);
+    return -2;
+  }
+  
+  ptr = mmap(0, args.size, PROT_READ|PROT_WRITE, MAP_SHARED, bo->ctx->fd, args.addr_ptr);
+  
+  if (ptr == MAP_FAILED)
+  {
+    fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+    return -3;
+  }
+  
+  bo->cpu_ptr = ptr;
+  
+  return 0;
+}
+
+void* compute_map_gpu_buffer(struct gpu_buffer* bo)
+{
+  if (compute_bo_cpu_map(bo))
+  {
+    return NULL;
+  }
+  
+  bo->map_count++;
+  compute_touch(bo);
+  
+  return bo->cpu_ptr;
+}
+
+void compute_unmap_gpu_buffer(struct gpu_buffer* bo)
+{
+  assert(bo->map_count > 0);
+  
+  ///the mapping itself stays cached, it is only torn down in compute_free_gpu_buffer
+  bo->map_count--;
+}
+
+static int compute_bo_range_valid(const struct gpu_buffer* bo, uint64_t offset, uint64_t size)
+{
+  return offset <= bo->size && size <= bo->size - offset;
+}
+
+///Invisible VRAM would be migrated into the visible window on every fault, those buffers are never mapped
+static int compute_bo_cpu_mappable(const struct gpu_buffer* bo)
+{
+  return bo->domain != RADEON_DOMAIN_VRAM || (bo->flags & (COMPUTE_BUFFER_CPU_ACCESS | COMPUTE_BUFFER_USERPTR));
+}
+
+void* compute_map_gpu_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size)
+{
+  char* ptr;
+  
+  if (!compute_bo_range_valid(bo, offset, size))
+  {
+    return NULL;
+  }
+  
+  if (!compute_bo_cpu_mappable(bo))
+  {
+    fprintf(stderr, "radeon: buffer 0x%08X was not allocated with COMPUTE_BUFFER_CPU_ACCESS\n", bo->handle);
+    return NULL;
+  }
+  
+  ptr = compute_map_gpu_buffer(bo);
+  
+  return ptr ? ptr + offset : NULL;
+}
+
+int compute_invalidate_mapped_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size)
+{
+  int r;
+  
+  if (!compute_bo_range_valid(bo, offset, size))
+  {
+    return -1;
+  }
+  
+  ///the end of pipe fence writes back the GPU caches, so waiting is all there is to do
+  r = compute_bo_sync_cpu(bo);
+  __sync_synchronize();
+  
+  return r;
+}
+
+int compute_flush_mapped_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size)
+{
+  if (!compute_bo_range_valid(bo, offset, size))
+  {
+    return -1;
+  }
+  
+  ///drains write-combining buffers, GTT is snooped and needs nothing else
+  __sync_synchronize();
+  compute_touch(bo);
+  
+  return 0;
+}
+
+///One contiguous piece of a GPU copy
+struct compute_copy_region
+{
+  uint64_t dst_offset;
+  uint64_t src_offset; ///fill pattern when there is no source buffer
+  uint64_t size;
+};
+
+///CP DMA on the compute ring, ordered after earlier launches.
+///Copies from src, or fills with the 32 bit pattern in src_offset when src is NULL.
+static int compute_cp_dma(struct gpu_buffer* dst, struct gpu_buffer* src, const struct compute_copy_region* regions, int count, struct compute_fence* fence)
+{
+  struct gpu_buffer* bos[2] = {dst, src};
+  uint64_t packets = 0;
+  unsigned* buf;
+  int cdw = 0;
+  int i;
+  int r;
+  
+  for (i = 0; i < count; i++)
+  {
+    packets += regions[i].size / CP_DMA_MAX_BYTES + 1;
+  }
+  
+  buf = malloc(sizeof(unsigned)*(8 + 6*packets + COMPUTE_FENCE_DW));
+  
+  ///earlier dispatches may still write the source, and the copy must not hit stale TC lines
+  buf[cdw++] = PKT3C(PKT3_EVENT_WRITE, 0, 0);
+  buf[cdw++] = EVENT_TYPE(V_028A90_CS_PARTIAL_FLUSH) | EVENT_INDEX(4);
+  
+  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
+  buf[cdw++] = S_0085F0_TC_ACTION_ENA(1);
+  buf[cdw++] = 0xffffffff;
+  buf[cdw++] = 0;
+  buf[cdw++] = 0xA;
+  
+  for (i = 0; i < count; i++)
+  {
+    uint64_t dst_va = dst->va + regions[i].dst_offset;
+    uint64_t src_va = src ? src->va + regions[i].src_offset : regions[i].src_offset;
+    uint64_t size = regions[i].size;
+    
+    while (size)
+    {
+      uint64_t n = size < CP_DMA_MAX_BYTES ? size : CP_DMA_MAX_BYTES;
+      ///only the last packet has to hold the CP until all data arrived
+      uint32_t sync = i == count - 1 && n == size ? CP_DMA_CP_SYNC : 0;
+      
+      buf[cdw++] = PKT3C(PKT3_CP_DMA, 4, 0);
+      buf[cdw++] = src_va;
+      buf[cdw++] = src ? ((src_va >> 32) & 0xFFFF) | CP_DMA_SRC_SEL(0) | sync :
+                         CP_DMA_SRC_SEL(2) | sync;
+      buf[cdw++] = dst_va;
+      buf[cdw++] = (dst_va >> 32) & 0xFFFF;
+      buf[cdw++] = CP_DMA_BYTE_COUNT(n);
+      
+      src_va += src ? n : 0;
+      dst_va += n;
+      size -= n;
+    }
+  }
+  
+  r = compute_submit(dst->ctx, COMPUTE_RING_COMPUTE, 1, buf, cdw, bos, src ? 2 : 1, fence);
+  
+  free(buf);
+  
+  return r;
+}
+
+int compute_fill_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, uint64_t size, uint32_t pattern, struct compute_fence* fence)
+{
+  if (!compute_bo_range_valid(bo, gpu_offset, size) || ((gpu_offset | size) & 3))
+  {
+    return -1;
+  }
+  
+  compute_touch(bo);
+  
+  struct compute_copy_region region = {gpu_offset, pattern, size};
+  
+  return compute_cp_dma(bo, NULL, &region, 1, fence);
+}
+
+int compute_copy_gpu(struct gpu_buffer* dst, uint64_t dst_offset, struct gpu_buffer* src, uint64_t src_offset, uint64_t size, struct compute_fence* fence)
+{
+  if (!compute_bo_range_valid(dst, dst_offset, size) || !compute_bo_range_valid(src, src_offset, size))
+  {
+    return -1;
+  }
+  
+  compute_touch(dst);
+  compute_touch(src);
+  
+  struct compute_copy_region region = {dst_offset, src_offset, size};
+  
+  return compute_cp_dma(dst, src, &region, 1, fence);
+}
+
+///Copies regions on the DMA ring in one submission, unaligned ones go to CP DMA
+static int compute_dma_regions(struct gpu_buffer* dst, struct gpu_buffer* src, const struct compute_copy_region* regions, int count, struct compute_fence* fence)
+{
+  struct compute_context* ctx = dst->ctx;
+  struct gpu_buffer* bos[2] = {dst, src};
+  uint64_t packets = 0;
+  uint64_t unaligned = 0;
+  unsigned* buf;
+  int cdw = 0;
+  int i;
+  int r;
+  
+  for (i = 0; i < count; i++)
+  {
+    unaligned |= (dst->va + regions[i].dst_offset) | (src->va + regions[i].src_offset) | regions[i].size;
+    packets += regions[i].size / DMA_COPY_MAX_BYTES + 1;
+  }
+  
+  ///the engine moves dwords, anything unaligned is left to the CP.
+  ///The engine can't wait for memory either, so copies depending on running compute work queue behind it.
+  if (!ctx->dma_ring || (unaligned & 3) || compute_dependency_pending(ctx, COMPUTE_RING_COMPUTE))
+  {
+    return compute_cp_dma(dst, src, regions, count, fence);
+  }
+  
+  buf = malloc(sizeof(unsigned)*(5*packets + COMPUTE_FENCE_DW));
+  
+  for (i = 0; i < count; i++)
+  {
+    uint64_t dst_va = dst->va + regions[i].dst_offset;
+    uint64_t src_va = src->va + regions[i].src_offset;
+    uint64_t size = regions[i].size;
+    
+    while (size)
+    {
+      uint64_t n = size < DMA_COPY_MAX_BYTES ? size : DMA_COPY_MAX_BYTES;
+      
+      buf[cdw++] = DMA_PACKET(DMA_PACKET_COPY, 1, 0, 0, n);
+      buf[cdw++] = dst_va & 0xFFFFFFFF;
+      buf[cdw++] = src_va & 0xFFFFFFFF;
+      buf[cdw++] = (dst_va >> 32) & 0xFF;
+      buf[cdw++] = (src_va >> 32) & 0xFF;
+      
+      src_va += n;
+      dst_va += n;
+      size -= n;
+    }
+  }
+  
+  r = compute_submit(ctx, COMPUTE_RING_DMA, 1, buf, cdw, bos, 2, fence);
+  
+  free(buf);
+  
+  return r;
+}
+
+int compute_dma_copy(struct gpu_buffer* dst, uint64_t dst_offset, struct gpu_buffer* src, uint64_t src_offset, uint64_t size, struct compute_fence* fence)
+{
+  struct compute_copy_region region = {dst_offset, src_offset, size};
+  
+  if (!compute_bo_range_valid(dst, dst_offset, size) || !compute_bo_range_valid(src, src_offset, size))
+  {
+    return -1;
+  }
+  
+  compute_touch(dst);
+  compute_touch(src);
+  
+  return compute_dma_regions(dst, src, &region, 1, fence);
+}
+
+///Lazily creates the GTT bounce buffer used for VRAM the CPU shouldn't map
+static int compute_staging_init(struct compute_context* ctx)
+{
+  if (ctx->staging)
+  {
+    return 0;
+  }
+  
+  ctx->staging = compute_alloc_gpu_buffer(ctx, ctx->staging_chunk*ctx->staging_slots, RADEON_DOMAIN_GTT, 4096, COMPUTE_BUFFER_INTERNAL);
+  
+  if (!ctx->staging)
+  {
+    return -1;
+  }
+  
+  if (compute_bo_cpu_map(ctx->staging))
+  {
+    compute_free_gpu_buffer(ctx->staging);
+    ctx->staging = NULL;
+    return -1;
+  }
+  
+  return 0;
+}
+
+int compute_set_staging(struct compute_context* ctx, uint64_t chunk_size, int slots)
+{
+  int i;
+  
+  if (chunk_size < 4096 || (chunk_size & 4095) || slots < 2 || slots > COMPUTE_STAGING_MAX_SLOTS)
+  {
+    fprintf(stderr, "radeon: invalid staging configuration: %i chunks of %lu bytes\n", slots, chunk_size);
+    return -1;
+  }
+  
+  if (ctx->staging)
+  {
+    for (i = 0; i < ctx->staging_slots; i++)
+    {
+      compute_fence_wait(ctx, &ctx->staging_fences[i]);
+    }
+    
+    compute_free_gpu_buffer(ctx->staging);
+    ctx->staging = NULL;
+  }
+  
+  ctx->staging_chunk = chunk_size;
+  ctx->staging_slots = slots;
+  ctx->staging_next = 0;
+  
+  return 0;
+}
+
+void compute_set_copy_threads(struct compute_context* ctx, int threads)
+{
+  if (ctx->copy_pool)
+  {
+    compute_copy_pool_destroy(ctx->copy_pool);
+    ctx->copy_pool = NULL;
+  }
+  
+  ctx->copy_threads = threads;
+}
+
+///CPUs on the NUMA node the device hangs off, read from sysfs, empty if unknown
+static void compute_device_cpulist(const struct compute_context* ctx, char* list, int size)
+{
+  struct stat st;
+  char path[128];
+  FILE* f;
+  
+  list[0] = 0;
+  
+  if (fstat(ctx->fd, &st))
+  {
+    return;
+  }
+  
+  snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/local_cpulist", major(st.st_rdev), minor(st.st_rdev));
+  f = fopen(path, "r");
+  
+  if (!f)
+  {
+    return;
+  }
+  
+  if (!fgets(list, size, f))
+  {
+    list[0] = 0;
+  }
+  
+  fclose(f);
+}
+
+static void compute_memcpy_cached(void* dst, const void* src, size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+///Host side copy for transfers, huge ones run on the copy pool and return when all slices are done
+///Creates the copy pool on first use, NULL when copies stay on the calling thread
+static struct compute_copy_pool* compute_copy_pool_get(struct compute_context* ctx)
+{
+  if (ctx->copy_threads > 0 && !ctx->copy_pool)
+  {
+    char cpulist[1024];
+    
+    compute_device_cpulist(ctx, cpulist, sizeof(cpulist));
+    ctx->copy_pool = compute_copy_pool_create(ctx->copy_threads, cpulist[0] ? cpulist : NULL);
+    
+    if (!ctx->copy_pool)
+    {
+      ctx->copy_threads = 0;
+    }
+  }
+  
+  return ctx->copy_pool;
+}
+
+static void compute_host_copy(struct compute_context* ctx, compute_memcpy_fn fn, void* dst, const void* src, uint64_t size)
+{
+  if (size >= COMPUTE_COPY_PARALLEL_THRESHOLD && compute_copy_pool_get(ctx))
+  {
+    compute_copy_pool_run(ctx->copy_pool, fn, dst, src, size);
+  }
+  else
+  {
+    fn(dst, src, size);
+  }
+}
+
+///Staging slots filled or drained with one host copy, 1 unless the transfer is big enough for the copy pool.
+///Then half the staging ring is copied by all workers at once while the GPU works on the other half.
+static int compute_staging_group(struct compute_context* ctx, uint64_t size)
+{
+  if (size < COMPUTE_COPY_PARALLEL_THRESHOLD || ctx->staging_slots < 2 || !compute_copy_pool_get(ctx))
+  {
+    return 1;
+  }
+  
+  return ctx->staging_slots / 2;
+}
+
+static void compute_staging_copy(struct compute_context* ctx, int group, compute_memcpy_fn fn, void* dst, const void* src, uint64_t size)
+{
+  if (group > 1)
+  {
+    compute_copy_pool_run(ctx->copy_pool, fn, dst, src, size);
+  }
+  else
+  {
+    fn(dst, src, size);
+  }
+}
+
+///Takes up to max consecutive staging slots for size bytes, waiting for the GPU copies that used them last.
+///*n is set to the bytes they hold, the slots don't wrap around the end of the staging buffer.
+static char* compute_staging_slots(struct compute_context* ctx, uint64_t size, int max, int* slot, uint64_t* n)
+{
+  int count;
+  int i;
+  
+  *slot = ctx->staging_next;
+  
+  if (max > ctx->staging_slots - *slot)
+  {
+    max = ctx->staging_slots - *slot;
+  }
+  
+  *n = size < max*ctx->staging_chunk ? size : max*ctx->staging_chunk;
+  count = (*n + ctx->staging_chunk - 1) / ctx->staging_chunk;
+  
+  if (count == 0)
+  {
+    count = 1;
+  }
+  
+  ctx->staging_next = (*slot + count) % ctx->staging_slots;
+  
+  for (i = 0; i < count; i++)
+  {
+    if (compute_fence_wait(ctx, &ctx->staging_fences[*slot + i]))
+    {
+      return NULL;
+    }
+  }
+  
+  return (char*)ctx->staging->cpu_ptr + *slot*ctx->staging_chunk;
+}
+
+///Takes the next staging slot, waiting for the GPU copy that used it last
+static char* compute_staging_slot(struct compute_context* ctx, int* slot)
+{
+  uint64_t n;
+  
+  return compute_staging_slots(ctx, ctx->staging_chunk, 1, slot, &n);
+}
+
+///Large transfers to VRAM outside the CPU visible window go through GTT staging and a GPU copy
+static int compute_use_staging(const struct gpu_buffer* bo, uint64_t size)
+{
+  return bo->domain == RADEON_DOMAIN_VRAM &&
+         !(bo->flags & (COMPUTE_BUFFER_CPU_ACCESS | COMPUTE_BUFFER_USERPTR | COMPUTE_BUFFER_IMPORTED)) &&
+         size >= COMPUTE_STAGING_THRESHOLD;
+}
+
+int compute_upload_staged(const struct gpu_buffer* bo, uint64_t size)
+{
+  return compute_use_staging(bo, size);
+}
+
+///Reading VRAM through a mapping is slow even inside the visible window, a GPU copy into cached GTT isn't
+static int compute_use_staging_readback(const struct gpu_buffer* bo, uint64_t size)
+{
+  return bo->domain == RADEON_DOMAIN_VRAM && (size >= COMPUTE_READBACK_THRESHOLD || !compute_bo_cpu_mappable(bo));
+}
+
+int compute_upload_async(struct gpu_buffer* bo, uint64_t gpu_offset, const void* src, uint64_t size, struct compute_fence* fence)
+{
+  struct compute_context* ctx = bo->ctx;
+  int r;
+  
+  if (!compute_bo_range_valid(bo, gpu_offset, size))
+  {
+    return -1;
+  }
+  
+  if (compute_staging_init(ctx))
+  {
+    return -1;
+  }
+  
+  int group = compute_staging_group(ctx, size);
+  
+  while (size)
+  {
+    uint64_t n;
+    int slot;
+    int i;
+    
+    ///the copy of the previous chunks runs while these are written
+    char* chunk = compute_staging_slots(ctx, size, group, &slot, &n);
+    
+    if (!chunk)
+    {
+      return -1;
+    }
+    
+    ///non-temporal stores keep the chunk out of the CPU caches, only the GPU reads it
+    compute_staging_copy(ctx, group, compute_memcpy_to_wc, chunk, src, n);
+    
+    r = compute_dma_copy(bo, gpu_offset, ctx->staging, slot*ctx->staging_chunk, n, &ctx->staging_fences[slot]);
+    
+    if (r)
+    {
+      return r;
+    }
+    
+    for (i = 1; i*ctx->staging_chunk < n; i++)
+    {
+      ctx->staging_fences[slot + i] = ctx->staging_fences[slot];
+    }
+    
+    ///the ring executes in order, so the last chunk's fence covers the whole upload
+    if (fence)
+    {
+      *fence = ctx->staging_fences[slot];
+    }
+    
+    src = (const char*)src + n;
+    gpu_offset += n;
+    size -= n;
+  }
+  
+  return 0;
+}
 
-  printf("cdw: %i\n", cdw);
+static int compute_staged_copy_from_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, void* dst, uint64_t size)
+{
+  struct compute_context* ctx = bo->ctx;
+  int r;
+  
+  if (compute_staging_init(ctx))
+  {
+    return -1;
+  }
+  
+  ///keeps the whole staging ring in flight ahead of the slots being read back
+  int group = compute_staging_group(ctx, size);
+  int slots[COMPUTE_STAGING_MAX_SLOTS];
+  uint64_t lengths[COMPUTE_STAGING_MAX_SLOTS];
+  uint64_t issued = 0;
+  uint64_t done = 0;
+  int first = 0;
+  int pending = 0;
+  int busy = 0; ///slots taken by pending copies
+  
+  while (done < size)
+  {
+    while (issued < size && busy < ctx->staging_slots)
+    {
+      int max = group < ctx->staging_slots - busy ? group : ctx->staging_slots - busy;
+      uint64_t n;
+      int slot;
+      int i;
+      
+      if (!compute_staging_slots(ctx, size - issued, max, &slot, &n))
+      {
+        return -1;
+      }
+      
+      r = compute_dma_copy(ctx->staging, slot*ctx->staging_chunk, bo, gpu_offset + issued, n, &ctx->staging_fences[slot]);
+      
+      if (r)
+      {
+        return r;
+      }
+      
+      for (i = 1; i*ctx->staging_chunk < n; i++)
+      {
+        ctx->staging_fences[slot + i] = ctx->staging_fences[slot];
+      }
+      
+      slots[(first + pending) % COMPUTE_STAGING_MAX_SLOTS] = slot;
+      lengths[(first + pending) % COMPUTE_STAGING_MAX_SLOTS] = n;
+      pending++;
+      busy += (n + ctx->staging_chunk - 1) / ctx->staging_chunk;
+      issued += n;
+    }
+    
+    uint64_t n = lengths[first];
+    int slot = slots[first];
+    
+    r = compute_fence_wait(ctx, &ctx->staging_fences[slot]);
+    
+    if (r)
+    {
+      return r;
+    }
+    
+    compute_staging_copy(ctx, group, compute_memcpy_cached, (char*)dst + done, (const char*)ctx->staging->cpu_ptr + slot*ctx->staging_chunk, n);
+    
+    first = (first + 1) % COMPUTE_STAGING_MAX_SLOTS;
+    pending--;
+    busy -= (n + ctx->staging_chunk - 1) / ctx->staging_chunk;
+    done += n;
+  }
+  
+  return 0;
+}
 
-  chunk_array[0] = (uint64_t)(uintptr_t)&chunks[0];
-  chunk_array[1] = (uint64_t)(uintptr_t)&chunks[1];
-  chunk_array[2] = (uint64_t)(uintptr_t)&chunks[2];
+int compute_copy_to_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, const void* src, uint64_t size)
+{
+  int r;
   
-  cs.num_chunks = 3;
-  cs.chunks = (uint64_t)(uintptr_t)chunk_array;
-  cs.cs_id = 1;
+  if (!compute_bo_range_valid(bo, gpu_offset, size))
+  {
+    return -1;
+  }
+  
+  if (compute_use_staging(bo, size))
+  {
+    return compute_upload_async(bo, gpu_offset, src, size, NULL);
+  }
+  
+  ///the CP writes small uploads into invisible VRAM from the IB or the arena
+  if (!compute_bo_cpu_mappable(bo) && size < COMPUTE_STAGING_THRESHOLD)
+  {
+    struct compute_scatter_entry entry = {src, gpu_offset, size};
+    
+    return compute_scatter_to_gpu(bo, &entry, 1, NULL);
+  }
+  
+  r = compute_bo_cpu_map(bo);
+  
+  if (r)
+  {
+    return r;
+  }
+  
+  compute_bo_sync_cpu(bo);
+  compute_touch(bo);
+  
+  compute_host_copy(bo->ctx, compute_memcpy_to_wc, (char*)bo->cpu_ptr + gpu_offset, src, size);
+  
+  return 0;
+}
+
+int compute_copy_from_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, void* dst, uint64_t size)
+{
+  int r;
+  
+  if (!compute_bo_range_valid(bo, gpu_offset, size))
+  {
+    return -1;
+  }
+  
+  if (compute_use_staging_readback(bo, size))
+  {
+    return compute_staged_copy_from_gpu(bo, gpu_offset, dst, size);
+  }
+  
+  r = compute_bo_cpu_map(bo);
+  
+  if (r)
+  {
+    return r;
+  }
+  
+  compute_bo_sync_cpu(bo);
+  compute_touch(bo);
+  
+  if (bo->domain == RADEON_DOMAIN_VRAM)
+  {
+    compute_host_copy(bo->ctx, compute_memcpy_from_wc, dst, (const char*)bo->cpu_ptr + gpu_offset, size);
+  }
+  else
+  {
+    compute_host_copy(bo->ctx, compute_memcpy_cached, dst, (const char*)bo->cpu_ptr + gpu_offset, size);
+  }
+  
+  return 0;
+}
+
+int compute_readback_begin(struct gpu_buffer* bo, uint64_t gpu_offset, void* dst, uint64_t size, struct compute_readback* rb)
+{
+  struct compute_context* ctx = bo->ctx;
+  long page_size = sysconf(_SC_PAGESIZE);
+  int r;
+  
+  memset(rb, 0, sizeof(*rb));
+  
+  if (!compute_bo_range_valid(bo, gpu_offset, size))
+  {
+    return -1;
+  }
+  
+  rb->dst = dst;
+  rb->size = size;
+  
+  if (size == 0)
+  {
+    return 0;
+  }
+  
+  ///page aligned destinations are written by the GPU directly, others land in GTT first
+  if (!((uintptr_t)dst & (page_size - 1)) && !(size & (page_size - 1)))
+  {
+    rb->bounce = compute_import_host_buffer(ctx, dst, size, 0);
+  }
+  
+  if (rb->bounce)
+  {
+    rb->bounce->flags |= COMPUTE_BUFFER_INTERNAL;
+  }
+  else
+  {
+    rb->bounce = compute_alloc_gpu_buffer(ctx, size, RADEON_DOMAIN_GTT, 4096, COMPUTE_BUFFER_INTERNAL);
+    
+    if (!rb->bounce || compute_bo_cpu_map(rb->bounce))
+    {
+      compute_readback_end(rb);
+      return -2;
+    }
+  }
+  
+  r = compute_dma_copy(rb->bounce, 0, bo, gpu_offset, size, &rb->fence);
+  
+  if (r)
+  {
+    compute_readback_end(rb);
+    return -2;
+  }
+  
+  return 0;
+}
+
+int compute_readback_done(const struct compute_readback* rb)
+{
+  return !rb->bounce || compute_fence_signaled(rb->bounce->ctx, &rb->fence);
+}
+
+void compute_readback_cancel(struct compute_readback* rb)
+{
+  if (!rb->bounce)
+  {
+    return;
+  }
+  
+  ///the GPU may still write the bounce or the pinned pages of dst
+  compute_fence_wait(rb->bounce->ctx, &rb->fence);
+  compute_free_gpu_buffer(rb->bounce);
+  rb->bounce = NULL;
+}
+
+int compute_readback_end(struct compute_readback* rb)
+{
+  int r = 0;
+  
+  if (!rb->bounce)
+  {
+    return 0;
+  }
+  
+  r = compute_fence_wait(rb->bounce->ctx, &rb->fence);
+  
+  if (!r && !(rb->bounce->flags & COMPUTE_BUFFER_USERPTR) && rb->bounce->cpu_ptr)
+  {
+    compute_host_copy(rb->bounce->ctx, compute_memcpy_cached, rb->dst, rb->bounce->cpu_ptr, rb->size);
+  }
+  
+  compute_free_gpu_buffer(rb->bounce);
+  rb->bounce = NULL;
+  
+  return r;
+}
+
+///Bytes from the first row to the end of the last one, -1 if rows or slices overlap or the span overflows.
+///A single row or slice doesn't need a pitch.
+static int compute_rect_span(const struct compute_rect* rect, uint64_t row_pitch, uint64_t slice_pitch, uint64_t* span)
+{
+  uint64_t slice_span;
+  
+  if (rect->rows > 1 && row_pitch < rect->row_size)
+  {
+    return -1;
+  }
+  
+  if (__builtin_mul_overflow((uint64_t)(rect->rows - 1), row_pitch, &slice_span) ||
+      __builtin_add_overflow(slice_span, rect->row_size, &slice_span))
+  {
+    return -1;
+  }
+  
+  if (rect->slices > 1 && slice_pitch < slice_span)
+  {
+    return -1;
+  }
+  
+  if (__builtin_mul_overflow((uint64_t)(rect->slices - 1), slice_pitch, span) ||
+      __builtin_add_overflow(*span, slice_span, span))
+  {
+    return -1;
+  }
+  
+  return 0;
+}
+
+static int compute_rect_valid(const struct gpu_buffer* bo, const struct compute_rect* rect)
+{
+  uint64_t span;
+  uint64_t host_span;
+  
+  if (!rect->row_size || !rect->rows || !rect->slices)
+  {
+    return 0;
+  }
+  
+  ///the host side is checked too, its row offsets must not wrap either
+  if (compute_rect_span(rect, rect->gpu_row_pitch, rect->gpu_slice_pitch, &span) ||
+      compute_rect_span(rect, rect->host_row_pitch, rect->host_slice_pitch, &host_span))
+  {
+    return 0;
+  }
+  
+  return compute_bo_range_valid(bo, rect->gpu_offset, span);
+}
+
+///Offsets of row i counted over all slices
+static uint64_t compute_rect_gpu_row(const struct compute_rect* rect, uint64_t i)
+{
+  return rect->gpu_offset + (i / rect->rows)*rect->gpu_slice_pitch + (i % rect->rows)*rect->gpu_row_pitch;
+}
+
+static uint64_t compute_rect_host_row(const struct compute_rect* rect, uint64_t i)
+{
+  return (i / rect->rows)*rect->host_slice_pitch + (i % rect->rows)*rect->host_row_pitch;
+}
+
+///Packs as many rows as fit into a staging chunk and scatters them with one GPU copy per chunk.
+///Uploads pass src and leave dst NULL, readbacks the other way around.
+static int compute_staged_copy_rect(struct gpu_buffer* bo, const struct compute_rect* rect, const char* src, char* dst)
+{
+  struct compute_context* ctx = bo->ctx;
+  struct compute_copy_region* regions;
+  uint64_t total = (uint64_t)rect->rows*rect->slices;
+  uint64_t per_chunk = ctx->staging_chunk / rect->row_size;
+  uint64_t i;
+  int to_gpu = src != NULL;
+  int r = 0;
+  
+  if (per_chunk == 0)
+  {
+    ///rows larger than a chunk are plain transfers already
+    for (i = 0; i < total && r == 0; i++)
+    {
+      r = to_gpu ? compute_upload_async(bo, compute_rect_gpu_row(rect, i), src + compute_rect_host_row(rect, i), rect->row_size, NULL) :
+                   compute_staged_copy_from_gpu(bo, compute_rect_gpu_row(rect, i), dst + compute_rect_host_row(rect, i), rect->row_size);
+    }
+    
+    return r;
+  }
+  
+  if (per_chunk > COMPUTE_RECT_MAX_REGIONS)
+  {
+    per_chunk = COMPUTE_RECT_MAX_REGIONS;
+  }
+  
+  regions = malloc(per_chunk*sizeof(struct compute_copy_region));
+  
+  for (i = 0; i < total && r == 0; i += per_chunk)
+  {
+    uint64_t n = total - i < per_chunk ? total - i : per_chunk;
+    uint64_t j;
+    int slot;
+    char* chunk = compute_staging_slot(ctx, &slot);
+    
+    if (!chunk)
+    {
+      r = -1;
+      break;
+    }
+    
+    for (j = 0; j < n; j++)
+    {
+      uint64_t staging_offset = slot*ctx->staging_chunk + j*rect->row_size;
+      
+      if (to_gpu)
+      {
+        compute_memcpy_to_wc(chunk + j*rect->row_size, src + compute_rect_host_row(rect, i + j), rect->row_size);
+        regions[j].dst_offset = compute_rect_gpu_row(rect, i + j);
+        regions[j].src_offset = staging_offset;
+      }
+      else
+      {
+        regions[j].dst_offset = staging_offset;
+        regions[j].src_offset = compute_rect_gpu_row(rect, i + j);
+      }
+      
+      regions[j].size = rect->row_size;
+    }
+    
+    if (to_gpu)
+    {
+      r = compute_dma_regions(bo, ctx->staging, regions, n, &ctx->staging_fences[slot]);
+      continue;
+    }
+    
+    r = compute_dma_regions(ctx->staging, bo, regions, n, &ctx->staging_fences[slot]);
+    
+    if (!r)
+    {
+      r = compute_fence_wait(ctx, &ctx->staging_fences[slot]);
+    }
+    
+    for (j = 0; j < n && r == 0; j++)
+    {
+      memcpy(dst + compute_rect_host_row(rect, i + j), chunk + j*rect->row_size, rect->row_size);
+    }
+  }
+  
+  free(regions);
+  
+  return r;
+}
+
+static int compute_copy_rect(struct gpu_buffer* bo, const struct compute_rect* rect, const char* src, char* dst)
+{
+  uint64_t total;
+  uint64_t i;
+  int to_gpu = src != NULL;
+  int r;
+  
+  if (!compute_rect_valid(bo, rect))
+  {
+    return -1;
+  }
+  
+  total = (uint64_t)rect->rows*rect->slices;
+  
+  if (to_gpu ? compute_use_staging(bo, total*rect->row_size) || !compute_bo_cpu_mappable(bo) :
+               compute_use_staging_readback(bo, total*rect->row_size))
+  {
+    if (compute_staging_init(bo->ctx))
+    {
+      return -1;
+    }
+    
+    compute_touch(bo);
+    
+    return compute_staged_copy_rect(bo, rect, src, dst);
+  }
+  
+  r = compute_bo_cpu_map(bo);
+  
+  if (r)
+  {
+    return r;
+  }
+  
+  compute_bo_sync_cpu(bo);
+  compute_touch(bo);
+  
+  for (i = 0; i < total; i++)
+  {
+    char* mapped = (char*)bo->cpu_ptr + compute_rect_gpu_row(rect, i);
+    uint64_t row = compute_rect_host_row(rect, i);
+    
+    if (to_gpu)
+    {
+      compute_memcpy_to_wc(mapped, src + row, rect->row_size);
+    }
+    else if (bo->domain == RADEON_DOMAIN_VRAM)
+    {
+      compute_memcpy_from_wc(dst + row, mapped, rect->row_size);
+    }
+    else
+    {
+      memcpy(dst + row, mapped, rect->row_size);
+    }
+  }
   
-  int r = drmCommandWriteRead(ctx->fd, DRM_RADEON_CS, &cs, sizeof(struct drm_radeon_cs));
+  return 0;
+}
 
-  printf("ret:%i\n", r);
+int compute_copy_rect_to_gpu(struct gpu_buffer* bo, const struct compute_rect* rect, const void* src)
+{
+  return compute_copy_rect(bo, rect, src, NULL);
+}
 
-  free(relocs);
+int compute_copy_rect_from_gpu(struct gpu_buffer* bo, const struct compute_rect* rect, void* dst)
+{
+  return compute_copy_rect(bo, rect, NULL, dst);
 }
 
-int compute_emit_compute_state(const struct compute_context* ctx, const struct compute_state* state)
+///Entries up to this size that are dword aligned are written by the CP straight from the IB
+#define COMPUTE_SCATTER_INLINE_MAX 64
+///Larger entries are regular transfers, everything between is packed into the arena
+#define COMPUTE_SCATTER_PACK_MAX   (64*1024)
+#define COMPUTE_SCATTER_BATCH      (1024*1024) ///arena bytes per submission
+#define COMPUTE_SCATTER_MAX_DW     (16*1024)   ///IB dwords per submission
+
+static int compute_scatter_inline(const struct compute_scatter_entry* e)
 {
-  struct drm_radeon_cs cs;
-  int i, r;
-  unsigned buf[1024];
+  return e->size <= COMPUTE_SCATTER_INLINE_MAX && !((e->gpu_offset | e->size) & 3);
+}
+
+///Submits entries [first, last) as one IB of WRITE_DATA and CP DMA packets
+static int compute_scatter_batch(struct gpu_buffer* bo, const struct compute_scatter_entry* entries, int first, int last,
+                                 uint64_t packed, uint64_t dws, struct compute_fence* fence)
+{
+  struct compute_context* ctx = bo->ctx;
+  char* arena_ptr = NULL;
+  uint64_t arena_va = 0;
+  unsigned* buf;
+  int last_packed = -1;
   int cdw = 0;
-  uint64_t chunk_array[5];
-  struct drm_radeon_cs_chunk chunks[5];
-  uint32_t flags[3];
-  struct cs_reloc_gem* relocs;
-  
-  set_compute_reg(R_00B804_COMPUTE_DIM_X,         state->dim[0]);
-  set_compute_reg(R_00B808_COMPUTE_DIM_Y,         state->dim[1]);
-  set_compute_reg(R_00B80C_COMPUTE_DIM_Z,         state->dim[2]);
-  set_compute_reg(R_00B810_COMPUTE_START_X,       state->start[0]);
-  set_compute_reg(R_00B814_COMPUTE_START_Y,       state->start[1]);
-  set_compute_reg(R_00B818_COMPUTE_START_Z,       state->start[2]);
+  int i;
+  int r;
   
-  set_compute_reg(R_00B81C_COMPUTE_NUM_THREAD_X,  S_00B81C_NUM_THREAD_FULL(state->num_thread[0]));
-  set_compute_reg(R_00B820_COMPUTE_NUM_THREAD_Y,  S_00B820_NUM_THREAD_FULL(state->num_thread[1]));
-  set_compute_reg(R_00B824_COMPUTE_NUM_THREAD_Z,  S_00B824_NUM_THREAD_FULL(state->num_thread[2]));
+  if (packed)
+  {
+    arena_ptr = compute_alloc_transient(ctx, packed, 4, &arena_va);
+    
+    if (!arena_ptr)
+    {
+      return -2;
+    }
+  }
   
-  set_compute_reg(R_00B82C_COMPUTE_MAX_WAVE_ID,   S_00B82C_MAX_WAVE_ID(0x200));
+  for (i = first; i < last; i++)
+  {
+    if (entries[i].size && entries[i].size <= COMPUTE_SCATTER_PACK_MAX && !compute_scatter_inline(&entries[i]))
+    {
+      last_packed = i;
+    }
+  }
   
-  set_compute_reg(R_00B830_COMPUTE_PGM_LO,        state->binary->va >> 8);
-  set_compute_reg(R_00B834_COMPUTE_PGM_HI,        state->binary->va >> 40);
+  buf = malloc(sizeof(unsigned)*(dws + COMPUTE_FENCE_DW));
   
-  set_compute_reg(R_00B848_COMPUTE_PGM_RSRC1,
-    S_00B848_VGPRS(state->vgpr_num) |  S_00B848_SGPRS(state->sgpr_num) |  S_00B848_PRIORITY(state->priority) |
-    S_00B848_FLOAT_MODE(0) | S_00B848_PRIV(0) | S_00B848_DX10_CLAMP(0) |
-    S_00B848_DEBUG_MODE(state->debug_mode) | S_00B848_IEEE_MODE(state->ieee_mode)
-  );
+  ///launches before may still read the old data
+  buf[cdw++] = PKT3C(PKT3_EVENT_WRITE, 0, 0);
+  buf[cdw++] = EVENT_TYPE(V_028A90_CS_PARTIAL_FLUSH) | EVENT_INDEX(4);
   
-  set_compute_reg(R_00B84C_COMPUTE_PGM_RSRC2,
-    S_00B84C_SCRATCH_EN(state->scratch_en) | S_00B84C_USER_SGPR(state->user_data_length) |
-    S_00B84C_TGID_X_EN(1) | S_00B84C_TGID_Y_EN(1) | S_00B84C_TGID_Z_EN(1) |
-    S_00B84C_TG_SIZE_EN(1) |
-    S_00B84C_TIDIG_COMP_CNT(0) |
-    S_00B84C_LDS_SIZE(state->lds_size) |
-    S_00B84C_EXCP_EN(state->excp_en)
-  );
+  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
+  buf[cdw++] = S_0085F0_TC_ACTION_ENA(1);
+  buf[cdw++] = 0xffffffff;
+  buf[cdw++] = 0;
+  buf[cdw++] = 0xA;
   
-  set_compute_reg(R_00B854_COMPUTE_RESOURCE_LIMITS,
-    S_00B854_WAVES_PER_SH(state->waves_per_sh) | S_00B854_TG_PER_CU(state->thread_groups_per_cu) |
-    S_00B854_LOCK_THRESHOLD(state->lock_threshold) | S_00B854_SIMD_DEST_CNTL(state->simd_dest_cntl) 
-  );
+  for (i = first; i < last; i++)
+  {
+    const struct compute_scatter_entry* e = &entries[i];
+    uint64_t dst_va = bo->va + e->gpu_offset;
+    
+    if (e->size == 0 || e->size > COMPUTE_SCATTER_PACK_MAX)
+    {
+      continue;
+    }
+    
+    if (compute_scatter_inline(e))
+    {
+      buf[cdw++] = PKT3C(PKT3_WRITE_DATA, 2 + e->size/4, 0);
+      buf[cdw++] = WRITE_DATA_DST_SEL(WRITE_DATA_DST_MEM) | WRITE_DATA_WR_CONFIRM;
+      buf[cdw++] = dst_va;
+      buf[cdw++] = dst_va >> 32;
+      memcpy(&buf[cdw], e->src, e->size);
+      cdw += e->size/4;
+      continue;
+    }
+    
+    memcpy(arena_ptr, e->src, e->size);
+    
+    buf[cdw++] = PKT3C(PKT3_CP_DMA, 4, 0);
+    buf[cdw++] = arena_va;
+    buf[cdw++] = ((arena_va >> 32) & 0xFFFF) | CP_DMA_SRC_SEL(0) | (i == last_packed ? CP_DMA_CP_SYNC : 0);
+    buf[cdw++] = dst_va;
+    buf[cdw++] = (dst_va >> 32) & 0xFFFF;
+    buf[cdw++] = CP_DMA_BYTE_COUNT(e->size);
+    
+    arena_ptr += (e->size + 3) & ~(uint64_t)3;
+    arena_va += (e->size + 3) & ~(uint64_t)3;
+  }
   
-  set_compute_reg(R_00B858_COMPUTE_STATIC_THREAD_MGMT_SE0,
-    S_00B858_SH0_CU_EN(state->se0_sh0_cu_en) | S_00B858_SH1_CU_EN(state->se0_sh1_cu_en)
-  );
+  r = compute_submit(ctx, COMPUTE_RING_COMPUTE, 1, buf, cdw, &bo, 1, fence);
   
-  set_compute_reg(R_00B85C_COMPUTE_STATIC_THREAD_MGMT_SE1,
-    S_00B85C_SH0_CU_EN(state->se1_sh0_cu_en) | S_00B85C_SH1_CU_EN(state->se1_sh1_cu_en)
-  );
+  free(buf);
   
+  return r;
+}
+
+int compute_scatter_to_gpu(struct gpu_buffer* bo, const struct compute_scatter_entry* entries, int count, struct compute_fence* fence)
+{
+  int first;
+  int i;
+  int r;
   
-  if (state->user_data_length)
+  for (i = 0; i < count; i++)
   {
-    buf[cdw++] = PKT3C(PKT3_SET_SH_REG, state->user_data_length, 0);
-    buf[cdw++] = (R_00B900_COMPUTE_USER_DATA_0 - SI_SH_REG_OFFSET) >> 2;
-
-    for (i = 0; i < state->user_data_length; i++)
+    if (!compute_bo_range_valid(bo, entries[i].gpu_offset, entries[i].size))
     {
-      buf[cdw++] = state->user_data[i];
+      return -1;
     }
   }
-
-
-  buf[cdw++] = PKT3C(PKT3_SURFACE_SYNC, 3, 0);
-  buf[cdw++] = S_0085F0_TCL1_ACTION_ENA(1) |
-               S_0085F0_SH_ICACHE_ACTION_ENA(1) |
-               S_0085F0_SH_KCACHE_ACTION_ENA(1) |
-               S_0085F0_TC_ACTION_ENA(1);
-
-  buf[cdw++] = 0xffffffff;
-  buf[cdw++] = 0;
-  buf[cdw++] = 0xA;
-
-  set_compute_reg(R_00B800_COMPUTE_DISPATCH_INITIATOR,
-    S_00B800_COMPUTE_SHADER_EN(1) | S_00B800_PARTIAL_TG_EN(0) |
-    S_00B800_FORCE_START_AT_000(0) | S_00B800_ORDERED_APPEND_ENBL(0) 
-  );
   
-  set_compute_reg(R_00B800_COMPUTE_DISPATCH_INITIATOR, 0);
-
-  flags[0] = RADEON_CS_USE_VM;
-  flags[1] = RADEON_CS_RING_COMPUTE;
+  compute_touch(bo);
   
-  chunks[0].chunk_id = RADEON_CHUNK_ID_FLAGS;
-  chunks[0].length_dw = 2;
-  chunks[0].chunk_data =  (uint64_t)(uintptr_t)&flags[0];
-
-  #define RELOC_SIZE (sizeof(struct cs_reloc_gem) / sizeof(uint32_t))
+  for (i = 0; i < count; i++)
+  {
+    if (entries[i].size > COMPUTE_SCATTER_PACK_MAX)
+    {
+      r = compute_copy_to_gpu(bo, entries[i].gpu_offset, entries[i].src, entries[i].size);
+      
+      if (r)
+      {
+        return r;
+      }
+    }
+  }
   
-  int reloc_num = 0;
-  relocs = compute_create_reloc_table(ctx, &reloc_num);
+  for (first = 0; first < count; first = i)
+  {
+    uint64_t packed = 0;
+    uint64_t dws = 7;
+    
+    for (i = first; i < count; i++)
+    {
+      const struct compute_scatter_entry* e = &entries[i];
+      
+      if (e->size > COMPUTE_SCATTER_PACK_MAX)
+      {
+        continue;
+      }
+      
+      if (compute_scatter_inline(e))
+      {
+        if (dws + 4 + e->size/4 > COMPUTE_SCATTER_MAX_DW)
+        {
+          break;
+        }
+        
+        dws += 4 + e->size/4;
+      }
+      else
+      {
+        if (dws + 6 > COMPUTE_SCATTER_MAX_DW || packed + e->size > COMPUTE_SCATTER_BATCH)
+        {
+          break;
+        }
+        
+        dws += 6;
+        packed += (e->size + 3) & ~(uint64_t)3;
+      }
+    }
+    
+    ///oversized entries were transferred above and are skipped by the batch
+    r = compute_scatter_batch(bo, entries, first, i, packed, dws, fence);
+    
+    if (r)
+    {
+      return r;
+    }
+  }
   
-  chunks[1].chunk_id = RADEON_CHUNK_ID_RELOCS;
-  chunks[1].length_dw = reloc_num*RELOC_SIZE;
-  chunks[1].chunk_data =  (uint64_t)(uintptr_t)relocs;
-
-  chunks[2].chunk_id = RADEON_CHUNK_ID_IB;
-  chunks[2].length_dw = cdw;
-  chunks[2].chunk_data =  (uint64_t)(uintptr_t)&buf[0];  
+  return 0;
+}
 
-//   printf("cdw: %i\n", cdw);
+///Host memory the file is read into, a userptr buffer the GPU copies from when the kernel allows it
+struct compute_loader
+{
+  struct gpu_buffer* bo; ///userptr buffer, or the context staging buffer
+  char* ptr;
+  uint64_t chunk;
+  int slots;
+  struct compute_fence* fences;
+  struct compute_fence loader_fences[COMPUTE_LOADER_SLOTS];
+};
 
-  chunk_array[0] = (uint64_t)(uintptr_t)&chunks[0];
-  chunk_array[1] = (uint64_t)(uintptr_t)&chunks[1];
-  chunk_array[2] = (uint64_t)(uintptr_t)&chunks[2];
+static int compute_loader_init(struct compute_context* ctx, struct compute_loader* loader)
+{
+  void* mem = NULL;
   
-  cs.num_chunks = 3;
-  cs.chunks = (uint64_t)(uintptr_t)chunk_array;
-  cs.cs_id = state->id;
+  memset(loader, 0, sizeof(struct compute_loader));
   
-  r = drmCommandWriteRead(ctx->fd, DRM_RADEON_CS, &cs, sizeof(struct drm_radeon_cs));
-
-//   printf("ret:%i\n", r);
+  ///plain anonymous memory takes O_DIRECT reads, GEM mappings don't
+  if (posix_memalign(&mem, 4096, COMPUTE_LOADER_CHUNK*COMPUTE_LOADER_SLOTS) == 0)
+  {
+    loader->bo = compute_import_host_buffer(ctx, mem, COMPUTE_LOADER_CHUNK*COMPUTE_LOADER_SLOTS, 0);
+    
+    if (loader->bo)
+    {
+      ///only the loader's own copies use it, launches shouldn't wait for it
+      loader->bo->flags |= COMPUTE_BUFFER_INTERNAL;
+      loader->ptr = mem;
+      loader->chunk = COMPUTE_LOADER_CHUNK;
+      loader->slots = COMPUTE_LOADER_SLOTS;
+      loader->fences = loader->loader_fences;
+      return 0;
+    }
+    
+    free(mem);
+  }
   
-  compute_bo_wait(state->binary); ///to see if it hangs
+  if (compute_staging_init(ctx))
+  {
+    return -1;
+  }
   
-  free(relocs);
+  loader->bo = ctx->staging;
+  loader->ptr = ctx->staging->cpu_ptr;
+  loader->chunk = ctx->staging_chunk;
+  loader->slots = ctx->staging_slots;
+  loader->fences = ctx->staging_fences;
   
-  return r;
+  return 0;
 }
 
-int compute_copy_to_gpu(struct gpu_buffer* bo, int gpu_offset, const void* src, int size)
+static void compute_loader_free(struct compute_context* ctx, struct compute_loader* loader)
 {
-  struct drm_radeon_gem_mmap args;
-  int r;
-  void* ptr;
+  int i;
   
-  if (size > bo->size + gpu_offset)
+  for (i = 0; i < loader->slots; i++)
   {
-    return -1;
+    compute_fence_wait(ctx, &loader->fences[i]);
   }
   
-  memset(&args, 0, sizeof(args));
+  if (loader->bo != ctx->staging)
+  {
+    compute_free_gpu_buffer(loader->bo);
+    free(loader->ptr);
+  }
+}
+
+///Reads len bytes at offset, retrying short reads, returns the number of bytes read before EOF or -1
+static int64_t compute_pread_full(int fd, char* dst, uint64_t len, uint64_t offset)
+{
+  uint64_t done = 0;
   
-  args.handle = bo->handle;
-  args.offset = gpu_offset;
-  args.size = (uint64_t)size;
-  r = drmCommandWriteRead(bo->ctx->fd,
-                          DRM_RADEON_GEM_MMAP,
-                          &args,
-                          sizeof(args));
-  if (r)
+  while (done < len)
   {
-    fprintf(stderr, "error mapping %p 0x%08X (error = %d)\n", bo, bo->handle, r);
-    return -2;
+    ssize_t n = pread(fd, dst + done, len - done, offset + done);
+    
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    
+    if (n < 0)
+    {
+      return -1;
+    }
+    
+    if (n == 0)
+    {
+      break;
+    }
+    
+    done += n;
   }
   
- ptr = mmap(0, args.size, PROT_READ|PROT_WRITE, MAP_SHARED, bo->ctx->fd, args.addr_ptr);
- 
- if (ptr == MAP_FAILED)
- {
-   fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-    return -3;
- }
- 
- memcpy(ptr, src, size);
- munmap(ptr, args.size);
- 
- return 0;
+  return done;
 }
 
-int compute_copy_from_gpu(struct gpu_buffer* bo, int gpu_offset, void* dst, int size)
+int compute_load_file(struct gpu_buffer* bo, uint64_t gpu_offset, const char* path, uint64_t file_offset, uint64_t size)
 {
-  struct drm_radeon_gem_mmap args;
-  int r;
-  void* ptr;
+  struct compute_context* ctx = bo->ctx;
+  struct compute_loader loader;
+  struct stat st;
+  uint64_t pos;
+  int direct = 1;
+  int slot = 0;
+  int fd;
+  int r = 0;
+  
+  fd = open(path, O_RDONLY | O_DIRECT);
+  
+  if (fd < 0)
+  {
+    ///tmpfs and some network filesystems don't do O_DIRECT
+    direct = 0;
+    fd = open(path, O_RDONLY);
+  }
   
-  if (size > bo->size + gpu_offset)
+  if (fd < 0)
   {
+    fprintf(stderr, "radeon: can't open %s: %s\n", path, strerror(errno));
     return -1;
   }
   
-  memset(&args, 0, sizeof(args));
+  if (size == 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size > file_offset)
+  {
+    size = st.st_size - file_offset;
+  }
   
-  args.handle = bo->handle;
-  args.offset = gpu_offset;
-  args.size = (uint64_t)size;
-  r = drmCommandWriteRead(bo->ctx->fd,
-                          DRM_RADEON_GEM_MMAP,
-                          &args,
-                          sizeof(args));
-  if (r)
+  if (size == 0 || !compute_bo_range_valid(bo, gpu_offset, size) || compute_loader_init(ctx, &loader))
   {
-    fprintf(stderr, "error mapping %p 0x%08X (error = %d)\n", bo, bo->handle, r);
-    return -2;
+    close(fd);
+    return -1;
   }
   
- ptr = mmap(0, args.size, PROT_READ|PROT_WRITE, MAP_SHARED, bo->ctx->fd, args.addr_ptr);
- 
- if (ptr == MAP_FAILED)
- {
-   fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-    return -3;
- }
- 
- memcpy(dst, ptr, size);
- munmap(ptr, args.size);
- 
- return 0;
+  ///GEM mappings fail O_DIRECT reads, and reads rounded up to whole blocks must stay inside a slot
+  if (direct && (loader.bo == ctx->staging || (loader.chunk & 4095)))
+  {
+    close(fd);
+    direct = 0;
+    fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+    {
+      fprintf(stderr, "radeon: can't open %s: %s\n", path, strerror(errno));
+      compute_loader_free(ctx, &loader);
+      return -1;
+    }
+  }
+  
+  if (!direct)
+  {
+    posix_fadvise(fd, file_offset, size, POSIX_FADV_SEQUENTIAL);
+  }
+  
+  compute_touch(bo);
+  
+  ///O_DIRECT wants block aligned offsets and lengths, so whole chunks are read from an aligned start
+  for (pos = file_offset & ~(uint64_t)4095; pos < file_offset + size && r == 0; pos += loader.chunk)
+  {
+    uint64_t begin = pos < file_offset ? file_offset - pos : 0;
+    uint64_t end = file_offset + size - pos < loader.chunk ? file_offset + size - pos : loader.chunk;
+    char* chunk = loader.ptr + slot*loader.chunk;
+    struct compute_copy_region region;
+    int64_t got;
+    
+    ///the copy out of this slot has to finish first, the copies of the other slots keep running
+    r = compute_fence_wait(ctx, &loader.fences[slot]);
+    
+    if (r)
+    {
+      break;
+    }
+    
+    got = compute_pread_full(fd, chunk, direct ? (end + 4095) & ~(uint64_t)4095 : end, pos);
+    
+    if (got < 0 && direct && errno == EINVAL)
+    {
+      ///the filesystem rejected the alignment after all, continue through the page cache
+      close(fd);
+      fd = open(path, O_RDONLY);
+      direct = 0;
+      got = fd < 0 ? -1 : compute_pread_full(fd, chunk, end, pos);
+    }
+    
+    if (got < (int64_t)end)
+    {
+      fprintf(stderr, "radeon: reading %s at %" PRIu64 " failed\n", path, pos);
+      r = -1;
+      break;
+    }
+    
+    if (!direct)
+    {
+      ///the data lives on in the GPU buffer, keeping it cached only pushes out other pages
+      posix_fadvise(fd, pos, end, POSIX_FADV_DONTNEED);
+    }
+    
+    region.dst_offset = gpu_offset + pos + begin - file_offset;
+    region.src_offset = slot*loader.chunk + begin;
+    region.size = end - begin;
+    
+    r = compute_dma_regions(bo, loader.bo, &region, 1, &loader.fences[slot]);
+    
+    slot = (slot + 1) % loader.slots;
+  }
+  
+  if (loader.bo == ctx->staging)
+  {
+    ctx->staging_next = slot;
+  }
+  
+  compute_loader_free(ctx, &loader);
+  
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  
+  return r;
 }
-
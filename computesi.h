@@ -10,6 +10,17 @@
 
 struct compute_context;
 
+enum compute_buffer_flags
+{
+  COMPUTE_BUFFER_INTERNAL = 1, ///owned by the context itself, e.g. the argument heap
+  COMPUTE_BUFFER_USERPTR  = 2, ///wraps host memory, cpu_ptr belongs to the caller
+  COMPUTE_BUFFER_IMPORTED = 4, ///dma-buf from another context, not accounted to this one
+  COMPUTE_BUFFER_PINNED   = 8, ///never spilled out of its domain or moved by VA compaction
+  COMPUTE_BUFFER_CPU_ACCESS = 16 ///mapped by the CPU often, kept in the CPU visible part of VRAM
+};
+
+#define COMPUTE_TRACE_FRAMES 4 ///callers recorded per traced allocation
+
 struct gpu_buffer
 {
   struct compute_context* ctx;
@@ -17,11 +28,34 @@ struct gpu_buffer
   uint64_t alignment;
   uint32_t handle;
   uint32_t domain;
-  uint32_t flags;
+  uint32_t flags; ///compute_buffer_flags
   uint64_t size;
   
   uint64_t va;
   uint64_t va_size;
+  uint64_t gem_size; ///bytes the GEM object occupies, what the domain budget is charged
+  uint32_t vm_flags; ///RADEON_VM_PAGE_* flags the buffer is mapped with
+  
+  void* cpu_ptr; ///cached CPU mapping of the whole buffer, lives until the buffer is freed
+  int map_count; ///outstanding compute_map_gpu_buffer calls
+  
+  uint64_t last_use; ///context use_clock at the last launch or transfer touching the buffer
+  
+  void* alloc_stack[COMPUTE_TRACE_FRAMES]; ///callers of the allocating call, innermost first, only set while tracing
+  uint64_t alloc_ns;      ///CLOCK_MONOTONIC at allocation, only set while tracing
+};
+
+struct gpu_buffer_view
+{
+  struct gpu_buffer* bo;
+  uint64_t offset; ///in bytes from the start of bo
+  uint64_t size;   ///in bytes
+  unsigned stride; ///element size in bytes, 0 for raw byte addressing
+  int num_format;  ///V_008F0C_BUF_NUM_FORMAT_*
+  int data_format; ///V_008F0C_BUF_DATA_FORMAT_*
+  
+  uint32_t descriptor[4]; ///cached buffer resource (V#)
+  uint64_t descriptor_va; ///address the cached descriptor was encoded for, 0 if invalid
 };
 
 struct pool_node
@@ -33,11 +67,158 @@ struct pool_node
   struct pool_node* next;
 };
 
+enum compute_ring_id
+{
+  COMPUTE_RING_COMPUTE = 0,
+  COMPUTE_RING_DMA,     ///async copy engine, runs concurrently with the compute ring
+  COMPUTE_RING_COUNT
+};
+
+///completes when the ring's fence buffer reached seq, seq 0 is always signaled
+struct compute_fence
+{
+  uint32_t ring;
+  uint32_t seq;
+};
+
+struct compute_ring_state
+{
+  struct gpu_buffer* fence_bo; ///written at the end of every submission on this ring
+  volatile uint32_t* fence_ptr; ///last retired sequence number
+  uint32_t last_seq; ///last submitted sequence number
+};
+
+#define COMPUTE_ARENA_MAX_MARKS 256
+
+struct compute_arena_mark
+{
+  struct compute_fence fence;
+  uint64_t pos; ///arena head when the submission was made
+};
+
+///ring of persistently mapped GTT memory, bump allocated and reclaimed as submissions retire.
+///head and tail are running byte counts, the ring offset is pos % size.
+struct compute_arena
+{
+  struct gpu_buffer* bo;
+  char* cpu_ptr;
+  uint64_t size;
+  uint64_t head; ///next free byte
+  uint64_t tail; ///oldest byte the GPU may still read
+  
+  struct compute_arena_mark marks[COMPUTE_ARENA_MAX_MARKS];
+  int mark_first;
+  int mark_count;
+};
+
+struct compute_heap
+{
+  uint64_t size;   ///reported by the device
+  uint64_t used;   ///allocated by this context
+  uint64_t peak;   ///highest used so far
+  uint64_t budget; ///limit for this context, defaults to size
+};
+
+#define COMPUTE_TRACE_BUCKETS 20 ///power of two size classes from 4K up to above 1G
+
+///Allocation statistics, only collected while tracing is enabled
+struct compute_alloc_trace
+{
+  int verbose;          ///log every allocation and free to stderr
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t live;        ///bytes in traced buffers
+  uint64_t peak;
+  uint32_t live_count;
+  uint32_t peak_count;
+  uint64_t lifetime_ns; ///summed over freed buffers
+  uint32_t histogram[COMPUTE_TRACE_BUCKETS]; ///allocations per size class
+};
+
+struct compute_memory_stats
+{
+  uint64_t size;        ///device total
+  uint64_t device_used; ///used by all processes, 0 if the kernel can't report it
+  uint64_t used;        ///allocated by this context
+  uint64_t budget;
+  uint64_t visible_size; ///CPU visible VRAM (BAR), VRAM only
+  uint64_t visible_used; ///taken by this context's COMPUTE_BUFFER_CPU_ACCESS buffers
+};
+
+///VA layout below the highest allocated address, everything above it is free
+struct compute_va_stats
+{
+  uint64_t end;          ///end of the highest buffer
+  uint64_t used;
+  uint64_t free;         ///sum of the holes between buffers
+  uint64_t largest_hole; ///free - largest_hole is roughly what compute_compact_va can win back
+  uint32_t holes;
+  uint32_t buffers;
+};
+
+#define COMPUTE_STAGING_MAX_SLOTS 8
+
+///What a kernel needs at launch, in natural units
+struct compute_kernel_info
+{
+  uint32_t vgprs;         ///per work-item
+  uint32_t sgprs;         ///per wave, user SGPRs and VCC included
+  uint32_t lds_size;      ///bytes per workgroup
+  uint32_t scratch_size;  ///bytes per work-item, there is no scratch support so it has to be 0
+  uint32_t user_sgprs;    ///SGPRs preloaded from user data, at most 16
+  uint32_t local_size[3]; ///required workgroup size, 0 accepts any
+};
+
+struct compute_code_heap;
+
+///Code uploaded once into a code heap, kernels of a heap are kept in offset order
+struct compute_kernel
+{
+  struct compute_code_heap* heap;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t va;
+  struct compute_kernel_info info;
+  struct compute_kernel* prev;
+  struct compute_kernel* next;
+};
+
+struct compute_code_heap
+{
+  struct gpu_buffer* bo; ///pinned VRAM, so kernel addresses never change
+  struct compute_kernel* kernels;
+  struct compute_code_heap* next;
+};
+
 struct compute_context
 {
   int fd; ///opened DRM interface
   struct pool_node* vm_pool;
   
+  struct compute_heap vram;
+  struct compute_heap gtt;
+  uint64_t vram_visible_size; ///CPU visible window of VRAM
+  uint64_t vram_visible_used; ///taken by COMPUTE_BUFFER_CPU_ACCESS buffers
+  
+  ///GTT bounce buffer for transfers to VRAM the CPU shouldn't map, split into staging_slots chunks,
+  ///so the CPU fills or drains one chunk while the GPU copies another
+  struct gpu_buffer* staging;
+  uint64_t staging_chunk;
+  int staging_slots;
+  int staging_next; ///slot the next chunk goes through
+  struct compute_fence staging_fences[COMPUTE_STAGING_MAX_SLOTS]; ///last GPU copy using each slot
+  
+  struct compute_copy_pool* copy_pool; ///splits huge host copies, created on first use
+  int copy_threads; ///workers besides the calling thread, 0 copies on the calling thread only
+  uint64_t use_clock; ///advanced on every buffer use, orders buffers for LRU spilling
+  
+  struct compute_ring_state rings[COMPUTE_RING_COUNT];
+  uint32_t dep_seq[COMPUTE_RING_COUNT]; ///per ring sequence submissions wait for, 0 for none
+  int dma_ring; ///the kernel runs the DMA ring, copies fall back to CP DMA on the compute ring otherwise
+  struct compute_alloc_trace* trace; ///NULL unless allocation tracing is enabled
+  
+  struct compute_arena* arena; ///transient uploads and kernel argument tables, created on first use
+  struct compute_code_heap* code_heaps; ///executable memory of kernels, grown on demand
 };
 
 struct compute_state
@@ -74,6 +255,12 @@ struct compute_state
   int tmpring_wavesize;
   
   struct gpu_buffer* binary;
+  uint64_t code_offset; ///start of the kernel in binary, 256 byte aligned
+  
+  ///buffers the kernel accesses besides binary. NULL submits every buffer of the context,
+  ///which also serializes the launch with all transfers in flight.
+  struct gpu_buffer** buffers;
+  int num_buffers;
 };
 
 enum radeon_bo_domain
@@ -85,15 +272,143 @@ enum radeon_bo_domain
 struct compute_context* compute_create_context(const char* drm_devfile);
 void compute_free_context(struct compute_context* ctx);
 
-void compute_flush_caches(const struct compute_context* ctx);
-uint64_t compute_pool_alloc(struct compute_context* ctx, uint64_t size, int alignment, struct gpu_buffer* bo);
+void compute_flush_caches(struct compute_context* ctx);
+int compute_get_memory_stats(struct compute_context* ctx, int domain, struct compute_memory_stats* stats);
+void compute_set_memory_budget(struct compute_context* ctx, int domain, uint64_t budget);
+int compute_fence_signaled(const struct compute_context* ctx, const struct compute_fence* fence);
+int compute_fence_wait(const struct compute_context* ctx, const struct compute_fence* fence);
+///Submissions made until the next call start after fences completed, without blocking the host.
+///The compute ring waits for them on the GPU, DMA copies depending on unfinished compute work
+///run on the compute ring instead. Only the newest fence of each ring is kept, count 0 clears.
+int compute_set_dependencies(struct compute_context* ctx, const struct compute_fence* fences, int count);
+uint64_t compute_pool_alloc(struct compute_context* ctx, uint64_t size, uint64_t alignment, struct gpu_buffer* bo);
 void compute_pool_free(struct compute_context* ctx, uint64_t va);
 
-int compute_copy_to_gpu(struct gpu_buffer* bo, int gpu_offset, const void* src, int size);
-int compute_copy_from_gpu(struct gpu_buffer* bo, int gpu_offset, void* dst, int size);
+///Starts collecting allocation statistics, also enabled by COMPUTE_TRACE_ALLOCS=1 (2 logs every call) at context creation.
+///A context with tracing prints a leak report of the buffers it still owns when it is freed.
+int compute_enable_alloc_trace(struct compute_context* ctx, int verbose);
+void compute_print_alloc_report(const struct compute_context* ctx, FILE* out);
+
+void compute_get_va_stats(const struct compute_context* ctx, struct compute_va_stats* stats);
+///Slides idle buffers down to close VA holes, returns the number moved or -1.
+///Moved buffers get a new bo->va, so GPU side copies of old addresses have to be refreshed by the caller.
+///Internal and COMPUTE_BUFFER_PINNED buffers keep their address.
+int compute_compact_va(struct compute_context* ctx);
+
+///does not synchronize with the GPU, use compute_bo_wait before touching memory the GPU may still use
+///VRAM mappings are uncached for CPU reads, read them with compute_memcpy_from_wc
+void* compute_map_gpu_buffer(struct gpu_buffer* bo);
+void compute_unmap_gpu_buffer(struct gpu_buffer* bo);
+
+///Maps a range of a GTT, userptr or COMPUTE_BUFFER_CPU_ACCESS buffer, released with compute_unmap_gpu_buffer.
+///Mappings are coherent: invalidate waits for GPU work on the buffer before the CPU reads it,
+///flush orders CPU writes before the next submission. Neither copies data.
+void* compute_map_gpu_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size);
+int compute_invalidate_mapped_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size);
+int compute_flush_mapped_range(struct gpu_buffer* bo, uint64_t offset, uint64_t size);
 
+///Large uploads into invisible VRAM go through staging, small ones are written by the CP, others through a mapping.
+///Invisible VRAM is never mapped, the kernel would migrate the whole buffer into the visible window.
+int compute_copy_to_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, const void* src, uint64_t size);
+
+///CP DMA on the compute ring, queued behind earlier launches like a kernel and not crossing PCIe.
+///Fill offset and size have to be multiples of 4.
+int compute_fill_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, uint64_t size, uint32_t pattern, struct compute_fence* fence);
+int compute_copy_gpu(struct gpu_buffer* dst, uint64_t dst_offset, struct gpu_buffer* src, uint64_t src_offset, uint64_t size, struct compute_fence* fence);
+
+///GPU copy on the DMA ring, returns without waiting. The kernel orders it with other submissions using src or dst.
+int compute_dma_copy(struct gpu_buffer* dst, uint64_t dst_offset, struct gpu_buffer* src, uint64_t src_offset, uint64_t size, struct compute_fence* fence);
+///Copies src into GTT staging and from there to the buffer on the DMA ring, src can be reused once this returns.
+///Only blocks while staging is still in use by an earlier transfer.
+int compute_upload_async(struct gpu_buffer* bo, uint64_t gpu_offset, const void* src, uint64_t size, struct compute_fence* fence);
+///Whether compute_copy_to_gpu goes through staging
+int compute_upload_staged(const struct gpu_buffer* bo, uint64_t size);
+///Staged transfers are split into chunk_size pieces cycling through slots staging chunks, 1M and 4 by default.
+///Waits for transfers using the current staging buffer.
+int compute_set_staging(struct compute_context* ctx, uint64_t chunk_size, int slots);
+///Host copies of 16M and more are split across threads workers pinned near the device, 3 by default
+///or COMPUTE_COPY_THREADS. Staged transfers of that size fill or drain half the staging slots per split copy.
+///0 keeps every copy on the calling thread.
+void compute_set_copy_threads(struct compute_context* ctx, int threads);
+int compute_copy_from_gpu(struct gpu_buffer* bo, uint64_t gpu_offset, void* dst, uint64_t size);
+
+///A readback in flight, dst must stay valid until compute_readback_end
+struct compute_readback
+{
+  struct gpu_buffer* bounce; ///userptr import of dst, or GTT memory copied to dst at the end
+  void* dst;
+  uint64_t size;
+  struct compute_fence fence;
+};
+
+///Queues a DMA ring copy into dst and returns without waiting, -1 for a bad range.
+///Page aligned destinations of whole pages are written by the GPU without a host copy.
+int compute_readback_begin(struct gpu_buffer* bo, uint64_t gpu_offset, void* dst, uint64_t size, struct compute_readback* rb);
+int compute_readback_done(const struct compute_readback* rb);
+///Waits for the copy, completes dst and releases the bounce memory, has to be called once for every begun readback
+int compute_readback_end(struct compute_readback* rb);
+///Releases a readback without touching dst, which may be gone already
+void compute_readback_cancel(struct compute_readback* rb);
+
+struct compute_scatter_entry
+{
+  const void* src;
+  uint64_t gpu_offset;
+  uint64_t size;
+};
+
+///Uploads many small regions with one submission, regions must not overlap and sources can be reused on return.
+///Dword aligned regions up to 64 bytes are written by the CP from the IB, regions up to 64K are packed
+///into the transient arena and copied by CP DMA, larger ones go through compute_copy_to_gpu.
+int compute_scatter_to_gpu(struct gpu_buffer* bo, const struct compute_scatter_entry* entries, int count, struct compute_fence* fence);
+
+///rows*slices rows of row_size bytes, pitches are in bytes, host pitches are relative to the host pointer
+struct compute_rect
+{
+  uint64_t gpu_offset;
+  uint64_t gpu_row_pitch;
+  uint64_t gpu_slice_pitch;
+  uint64_t host_row_pitch;
+  uint64_t host_slice_pitch;
+  uint64_t row_size;
+  uint32_t rows;
+  uint32_t slices; ///1 for 2D
+};
+
+///Strided copies without packing on the host. Mappable buffers are copied row by row through the mapping,
+///others have the rows packed into staging and scattered by one GPU copy per staging chunk.
+///-1 if the rectangle exceeds the buffer or its pitches make rows or slices overlap.
+int compute_copy_rect_to_gpu(struct gpu_buffer* bo, const struct compute_rect* rect, const void* src);
+int compute_copy_rect_from_gpu(struct gpu_buffer* bo, const struct compute_rect* rect, void* dst);
+
+///Streams size bytes of a file (the rest of it for 0) into the buffer, returns once the data arrived.
+///Chunks are read with O_DIRECT into pinned host memory while the GPU copies the previous ones,
+///without O_DIRECT support the reads go through the page cache and drop the pages behind them.
+int compute_load_file(struct gpu_buffer* bo, uint64_t gpu_offset, const char* path, uint64_t file_offset, uint64_t size);
+
+int compute_buffer_view_init(struct gpu_buffer_view* view, struct gpu_buffer* bo, uint64_t offset, uint64_t size, unsigned stride, int num_format, int data_format);
+const uint32_t* compute_buffer_view_descriptor(struct gpu_buffer_view* view);
+
+struct compute_arena* compute_create_arena(struct compute_context* ctx, uint64_t size);
+void compute_free_arena(struct compute_arena* arena);
+void* compute_arena_alloc(struct compute_arena* arena, uint64_t size, uint64_t alignment, uint64_t* va);
+void* compute_alloc_transient(struct compute_context* ctx, uint64_t size, uint64_t alignment, uint64_t* va);
+uint64_t compute_upload_transient(struct compute_context* ctx, const void* data, uint64_t size, uint64_t alignment);
+uint64_t compute_upload_arguments(struct compute_context* ctx, const void* data, uint64_t size);
+
+int compute_bo_wait(struct gpu_buffer* bo);
 void compute_free_gpu_buffer(struct gpu_buffer* bo);
-struct gpu_buffer* compute_alloc_gpu_buffer(struct compute_context* ctx, int size, int domain, int alignment);
-int compute_emit_compute_state(const struct compute_context* ctx, const struct compute_state* state);
+struct gpu_buffer* compute_alloc_gpu_buffer(struct compute_context* ctx, uint64_t size, int domain, uint64_t alignment, uint32_t flags);
+struct gpu_buffer* compute_import_host_buffer(struct compute_context* ctx, void* ptr, uint64_t size, int read_only);
+int compute_export_gpu_buffer(struct gpu_buffer* bo, int* dmabuf_fd);
+struct gpu_buffer* compute_import_gpu_buffer(struct compute_context* ctx, int dmabuf_fd);
+///Uploads code into the context's code heap. The context owns its kernels, those not freed before are freed with it.
+struct compute_kernel* compute_create_kernel(struct compute_context* ctx, const void* code, uint64_t size, const struct compute_kernel_info* info);
+void compute_free_kernel(struct compute_kernel* kernel);
+///Sets binary, code_offset and the register, LDS and occupancy fields from the kernel and pads user data to its
+///user SGPRs. num_thread and user_data have to be filled in before, -1 if they don't match the kernel.
+int compute_kernel_setup_state(const struct compute_kernel* kernel, struct compute_state* state);
+
+int compute_emit_compute_state(struct compute_context* ctx, const struct compute_state* state, struct compute_fence* fence);
 
 #endif
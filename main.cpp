@@ -14,6 +14,7 @@
 extern "C" {
 #include "computesi.h"
 };
+#include "compute_interface.hpp"
 
 
 using namespace std;
@@ -44,42 +45,6 @@ enum mtbuf_op{
 
 #define BUFFER_ATOMIC_ADD 50
 
-struct buffer_resource{
-  buffer_resource()
-  {
-    data[0] = 0;
-    data[1] = 0;
-    data[2] = 0;
-    data[3] = 0;
-  }
-  
-  union{
-    struct {
-      uint64_t base_addr    : 48;
-      unsigned stride       : 14;
-      unsigned c_swizzle    : 1;
-      unsigned swizzle_en   : 1;
-      unsigned num_records  : 32;
-      unsigned dst_sel_x    : 3;
-      unsigned dst_sel_y    : 3;
-      unsigned dst_sel_z    : 3;
-      unsigned dst_sel_w    : 3;
-      unsigned num_format   : 3;
-      unsigned data_format  : 4;
-      unsigned element_size : 2;
-      unsigned idx_stride   : 2;
-      unsigned add_tid_en   : 1;
-      unsigned reserved     : 1;
-      unsigned hash_en      : 1;
-      unsigned heap         : 1;
-      unsigned unused       : 3;
-      unsigned zero         : 2;
-    } __attribute__((packed));
-    
-    uint32_t data[4];
-  };
-};
-
 void mtbuf(unsigned *&p, int nfmt, int dfmt, int op, int addr64, int glc, int idxen, int offen, int offset, int soffset, int tfe, int slc, int srsrc, int vdata, int vaddr)
 {
   p[0] = 0xE8000000;
@@ -458,6 +423,25 @@ int64_t get_time_usec()
 }
 
 
+///Events share the context, so waiting for or dropping one after its interface is gone must still work
+void check_event_outlives_interface()
+{
+  std::vector<unsigned> result(1024);
+  Event waited;
+  Event dropped;
+  
+  {
+    ComputeInterface gpu("/dev/dri/card0");
+    gpu_buffer* buf = gpu.bufferAlloc(result.size()*sizeof(result[0]));
+    
+    waited = gpu.transferFromGPUAsync(buf, 0, result);
+    dropped = gpu.transferFromGPUAsync(buf, 0, result);
+  }
+  
+  waited.wait();
+  
+  std::cout << "event outlived interface: " << (waited.ready() ? "ok" : "FAILED") << std::endl;
+}
 
 int main()
 {
@@ -489,8 +473,8 @@ int main()
   compute_context* ctx = compute_create_context("/dev/dri/card0");
   
   int test_data_size = 1024*1024*16;
-  gpu_buffer* code_bo = compute_alloc_gpu_buffer(ctx, 1024*1024*4, RADEON_DOMAIN_VRAM, 4096);
-  gpu_buffer* data_bo = compute_alloc_gpu_buffer(ctx, test_data_size*4, RADEON_DOMAIN_VRAM, 4096);
+  gpu_buffer* code_bo = compute_alloc_gpu_buffer(ctx, 1024*1024*4, RADEON_DOMAIN_VRAM, 4096, 0);
+  gpu_buffer* data_bo = compute_alloc_gpu_buffer(ctx, test_data_size*4, RADEON_DOMAIN_VRAM, 4096, 0);
   
   unsigned prog[1024*1024*1];
   
@@ -502,19 +486,11 @@ int main()
   
   unsigned *p = &prog[0];
   
-  buffer_resource bufres;
+  gpu_buffer_view bufres;
+  
+  compute_buffer_view_init(&bufres, data_bo, 0, 1024*10*4, 4, V_008F0C_BUF_NUM_FORMAT_UINT, V_008F0C_BUF_DATA_FORMAT_32);
   
-  bufres.base_addr = data_bo->va;
-  bufres.stride = 4;
-  bufres.num_records = 1024*10;
-  bufres.dst_sel_x = 4;
-  bufres.dst_sel_y = 4;
-  bufres.dst_sel_z = 4;
-  bufres.dst_sel_w = 4;
-  bufres.num_format = 4;
-  bufres.data_format = 4;
-  bufres.element_size = 1;
-  bufres.add_tid_en = 0;
+  const uint32_t* bufres_desc = compute_buffer_view_descriptor(&bufres);
 
   printf("buf addr%x, code addr: %x\n", data_bo->va, code_bo->va);
 //  printf("buf addr%p\n", data_bo->va >> 11);
@@ -524,14 +500,14 @@ rak_adam: bit 0-4 are the fault type (bit 0 - range, bit 1 - pde, bit 2 - valid,
 rak_adam: 0x48 is the TC (texture cache)
 
 */
-  printf("resource: %.8x %.8x %.8x %.8x\n", bufres.data[0], bufres.data[1], bufres.data[2], bufres.data[3]);
+  printf("resource: %.8x %.8x %.8x %.8x\n", bufres_desc[0], bufres_desc[1], bufres_desc[2], bufres_desc[3]);
   
 
 /*
-  s_mov_imm32(p, 4, bufres.data[0]);
-  s_mov_imm32(p, 5, bufres.data[1]);
-  s_mov_imm32(p, 6, bufres.data[2]);
-  s_mov_imm32(p, 7, bufres.data[3]);
+  s_mov_imm32(p, 4, bufres_desc[0]);
+  s_mov_imm32(p, 5, bufres_desc[1]);
+  s_mov_imm32(p, 6, bufres_desc[2]);
+  s_mov_imm32(p, 7, bufres_desc[3]);
   */
 //  s_getreg_b32(p, 4, 31, 0, 4);
 
@@ -716,14 +692,9 @@ rak_adam: 0x48 is the TC (texture cache)
   
   unsigned* test_data = new unsigned[test_data_size];
   
-  for (int i = 0; i < 1024; i++)
-  {
-    test_data[i] = 0xDEADBEEF;
-  }
-  
-  test_data[0] = 1;
-
-  compute_copy_to_gpu(data_bo, 0, &test_data[0], test_data_size*4);
+  ///data_bo is invisible VRAM, the seed is written by the CP like the rest instead of mapping the buffer
+  compute_fill_gpu(data_bo, 0, 4, 1, NULL);
+  compute_fill_gpu(data_bo, 4, test_data_size*4 - 4, 0xDEADBEEF, NULL);
   
   compute_state state;
   
@@ -732,10 +703,10 @@ rak_adam: 0x48 is the TC (texture cache)
   state.id = 0;
   state.user_data_length = 4;
   
-  state.user_data[0] = bufres.data[0];
-  state.user_data[1] = bufres.data[1];
-  state.user_data[2] = bufres.data[2];
-  state.user_data[3] = bufres.data[3];
+  state.user_data[0] = bufres_desc[0];
+  state.user_data[1] = bufres_desc[1];
+  state.user_data[2] = bufres_desc[2];
+  state.user_data[3] = bufres_desc[3];
   
   state.dim[0] = 32;
   state.dim[1] = 1;
@@ -766,12 +737,21 @@ rak_adam: 0x48 is the TC (texture cache)
   state.tmpring_waves = 0;
   state.tmpring_wavesize = 0;
   state.binary = code_bo;
+  state.code_offset = 0;
+  state.buffers = NULL;
+  state.num_buffers = 0;
 
   int e;
+  compute_fence fence;
 
   int64_t start_time = get_time_usec();
 
-  e = compute_emit_compute_state(ctx, &state);
+  e = compute_emit_compute_state(ctx, &state, &fence);
+  
+  if (e == 0)
+  {
+    compute_fence_wait(ctx, &fence);
+  }
 
   int64_t stop_time = get_time_usec();
 
@@ -838,6 +818,8 @@ rak_adam: 0x48 is the TC (texture cache)
   cout << double(1000*iternum)*global_size / double(stop_time-start_time) * 1E-3 << "Giter/s" << endl;
   cout << double(laststop - firststart) / double(1000*iternum) << " cycles / iter" << endl;
   compute_free_context(ctx);
+  
+  check_event_outlives_interface();
 }
 
 